@@ -56,11 +56,6 @@ if [ $PSRAM -ne 0 ] ; then
     CMAKE_ARGS="$CMAKE_ARGS -DUSE_PSRAM=1"
 fi
 
-MIRROR_FRAMEBUFFER=$((USE_PSRAM || DISP_WIDTH != 640))
-if [ "$MIRROR_FRAMEBUFFER" -eq 0 ]; then
-    CMAKE_ARGS="$CMAKE_ARGS -DHSTX_CKP=12 -DHSTX_D0P=14 -DHSTX_D1P=16 -DHSTX_D2P=18 "
-fi
-
 # Append disk name to build directory if disk image is specified
 if [ -n "$DISC_IMAGE" ] && [ -f "$DISC_IMAGE" ]; then
     # Extract filename without extension
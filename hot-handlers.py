@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+#
+# Turn the handler call counts printed by a PROFILE_HANDLERS=ON build into
+# a HOT_HANDLERS list:  one "<function> <size>" line per opcode handler
+# (m68k_op_*), hottest first.  CMake places as many as fit in
+# HOT_HANDLERS_BUDGET bytes into SRAM.
+#
+# Usage: hot-handlers.py <firmware.elf> <uart log> [<uart log>...] > hot.txt
+#
+# Counts are summed over the last complete dump in each log, so several
+# logs (e.g. from different workloads) can be combined.
+#
+# MIT License
+#
+# Copyright (c) 2024 Matt Evans
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+import os
+import re
+import subprocess
+import sys
+
+NM = os.environ.get("NM", "arm-none-eabi-nm")
+
+
+def symbols(elf):
+    """Map function address -> (name, size) for text symbols in the ELF."""
+    out = subprocess.run([NM, "--print-size", "--defined-only", elf],
+                         check=True, capture_output=True, text=True).stdout
+    syms = {}
+    for line in out.splitlines():
+        f = line.split()
+        if len(f) == 4 and f[2] in "tT":
+            syms[int(f[0], 16) & ~1] = (f[3], int(f[1], 16))
+    return syms
+
+
+def last_dump(path):
+    """Return {address: count} from the last complete dump in a log."""
+    dump, cur = {}, None
+    with open(path, errors="replace") as log:
+        for line in log:
+            m = re.search(r"prof: (begin|end|([0-9a-f]{8}) (\d+))", line)
+            if not m:
+                continue
+            if m.group(1) == "begin":
+                cur = {}
+            elif m.group(1) == "end":
+                if cur is not None:
+                    dump = cur
+                cur = None
+            elif cur is not None:
+                cur[int(m.group(2), 16) & ~1] = int(m.group(3))
+    return dump
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit("usage: %s <firmware.elf> <uart log>..." % sys.argv[0])
+
+    syms = symbols(sys.argv[1])
+    counts = {}
+    for path in sys.argv[2:]:
+        dump = last_dump(path)
+        if not dump:
+            sys.exit("%s: no complete profile dump found" % path)
+        for addr, n in dump.items():
+            counts[addr] = counts.get(addr, 0) + n
+
+    for addr, n in sorted(counts.items(), key=lambda c: -c[1]):
+        if addr not in syms:
+            print("warning: no symbol at %08x" % addr, file=sys.stderr)
+            continue
+        name, size = syms[addr]
+        # Anything else (e.g. an m68ki_* helper) is inlined in the real
+        # build, so has no section of its own to place
+        if not name.startswith("m68k_op_"):
+            continue
+        print("%s %d" % (name, size))
+
+
+if __name__ == "__main__":
+    main()
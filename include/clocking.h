@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 enum clk_sys_speed {
@@ -9,3 +10,6 @@ enum clk_sys_speed {
 };
 
 extern void overclock(enum clk_sys_speed clk_sys_div, uint32_t bit_clk_hz);
+extern void set_psram_timing(void);
+extern void qmi_calibrate(const void *flash_test, bool psram);
+extern bool clock_set_sys_speed(enum clk_sys_speed speed);
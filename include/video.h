@@ -30,4 +30,16 @@
 
 void    video_init(uint32_t *framebuffer);
 
+/* Incremented by the video output as the last framebuffer line has been
+ * sent, i.e. at the start of vertical blanking:
+ */
+extern volatile unsigned int video_frame_count;
+
+#if SHOW_STATS
+/* Microseconds spent in the video output's IRQ handler, i.e. the CPU
+ * time video costs the core running it (to 1us per IRQ):
+ */
+extern volatile unsigned int video_irq_us;
+#endif
+
 #endif
@@ -4,6 +4,7 @@
 #include "pico.h"
 #include "pico/stdio.h"
 #include "hardware/clocks.h"
+#include "hardware/pio.h"
 #include "hardware/pll.h"
 #include "hardware/structs/ioqspi.h"
 #include "hardware/structs/qmi.h"
@@ -36,15 +37,14 @@ static void __no_inline_not_in_flash_func(set_qmi_timing)() {
 
 #define SEC_TO_FS 1000000000000000ll
 
-static void __no_inline_not_in_flash_func(set_psram_timing)(void) {
-    // Get secs / cycle for the system clock - get before disabling interrupts.
-    uint32_t sysHz = (uint32_t)clock_get_hz(clk_sys);
+// The clk_sys_speed tiers divide down 528MHz
+#define CLK_SYS_TIER_BASE_HZ (528 * MHZ)
 
+// M1 timing for PSRAM with clk_sys at sysHz
+static uint32_t psram_timing_for(uint32_t sysHz) {
     // Calculate the clock divider - goal to get clock used for PSRAM <= what
     // the PSRAM IC can handle - which is defined in RP2350_PSRAM_MAX_SCK_HZ
-    volatile uint8_t clockDivider = (sysHz + RP2350_PSRAM_MAX_SCK_HZ - 1) / RP2350_PSRAM_MAX_SCK_HZ;
-
-    uint32_t intr_stash = save_and_disable_interrupts();
+    uint8_t clockDivider = (sysHz + RP2350_PSRAM_MAX_SCK_HZ - 1) / RP2350_PSRAM_MAX_SCK_HZ;
 
     // Get the clock femto seconds per cycle.
 
@@ -52,28 +52,349 @@ static void __no_inline_not_in_flash_func(set_psram_timing)(void) {
 
     // the maxSelect value is defined in units of 64 clock cycles
     // So maxFS / (64 * fsPerCycle) = maxSelect = RP2350_PSRAM_MAX_SELECT_FS64/fsPerCycle
-    volatile uint8_t maxSelect = RP2350_PSRAM_MAX_SELECT_FS64 / fsPerCycle;
+    uint8_t maxSelect = RP2350_PSRAM_MAX_SELECT_FS64 / fsPerCycle;
 
     //  minDeselect time - in system clock cycle
     // Must be higher than 50ns (min deselect time for PSRAM) so add a fsPerCycle - 1 to round up
     // So minFS/fsPerCycle = minDeselect = RP2350_PSRAM_MIN_DESELECT_FS/fsPerCycle
 
-    volatile uint8_t minDeselect = (RP2350_PSRAM_MIN_DESELECT_FS + fsPerCycle - 1) / fsPerCycle;
+    uint8_t minDeselect = (RP2350_PSRAM_MIN_DESELECT_FS + fsPerCycle - 1) / fsPerCycle;
+
+    return QMI_M1_TIMING_PAGEBREAK_VALUE_1024 << QMI_M1_TIMING_PAGEBREAK_LSB | // Break between pages.
+           3 << QMI_M1_TIMING_SELECT_HOLD_LSB | // Delay releasing CS for 3 extra system cycles.
+           1 << QMI_M1_TIMING_COOLDOWN_LSB | 1 << QMI_M1_TIMING_RXDELAY_LSB |
+           maxSelect << QMI_M1_TIMING_MAX_SELECT_LSB | minDeselect << QMI_M1_TIMING_MIN_DESELECT_LSB |
+           clockDivider << QMI_M1_TIMING_CLKDIV_LSB;
+}
+
+void __no_inline_not_in_flash_func(set_psram_timing)(void) {
+    // Get secs / cycle for the system clock - get before disabling interrupts.
+    uint32_t sysHz = (uint32_t)clock_get_hz(clk_sys);
+    uint32_t timing = psram_timing_for(sysHz);
 
     printf("syshz=%u\n", sysHz);
-    printf("Max Select: %d, Min Deselect: %d, clock divider: %d\n", maxSelect, minDeselect, clockDivider);
+    printf("Max Select: %d, Min Deselect: %d, clock divider: %d\n",
+           (int)((timing & QMI_M1_TIMING_MAX_SELECT_BITS) >> QMI_M1_TIMING_MAX_SELECT_LSB),
+           (int)((timing & QMI_M1_TIMING_MIN_DESELECT_BITS) >> QMI_M1_TIMING_MIN_DESELECT_LSB),
+           (int)((timing & QMI_M1_TIMING_CLKDIV_BITS) >> QMI_M1_TIMING_CLKDIV_LSB));
+
+    uint32_t intr_stash = save_and_disable_interrupts();
+    qmi_hw->m[1].timing = timing;
+    restore_interrupts(intr_stash);
+}
+
+// QMI timing calibration
+//
+// For each chip select, reads a known pattern back through the uncached XIP
+// alias while sweeping CLKDIV (from the fastest the device is rated for, up
+// to the current setting) and RXDELAY.  The first divider with a window of
+// at least QMI_CAL_MIN_WINDOW passing RXDELAY values is used, with RXDELAY in
+// the middle of the window for margin.  COOLDOWN is left as it was.  Only
+// the read sampling point is ever pushed past the current setting, so the
+// commands the device sees are always in spec.
+//
+// In practice this is RXDELAY centring: set_psram_timing() already picks
+// the fastest PSRAM divider in spec, and so does the flash setup at 264MHz,
+// so the divider only drops where the boot setting was slower than the
+// device's rating allows (e.g. flash on the DVFS lower tiers).
+
+#ifndef RP2350_FLASH_MAX_SCK_HZ
+#define RP2350_FLASH_MAX_SCK_HZ (133000000)
+#endif
+
+#define QMI_CAL_WORDS 256
+#define QMI_CAL_PASSES 4 // Reads of the pattern per setting, which must all match
+#define QMI_CAL_MIN_WINDOW 2
+
+#define QMI_NOCACHE_OFFSET (XIP_NOCACHE_NOALLOC_BASE - XIP_BASE)
 
-    qmi_hw->m[1].timing = QMI_M1_TIMING_PAGEBREAK_VALUE_1024 << QMI_M1_TIMING_PAGEBREAK_LSB | // Break between pages.
-                          3 << QMI_M1_TIMING_SELECT_HOLD_LSB | // Delay releasing CS for 3 extra system cycles.
-                          1 << QMI_M1_TIMING_COOLDOWN_LSB | 1 << QMI_M1_TIMING_RXDELAY_LSB |
-                          maxSelect << QMI_M1_TIMING_MAX_SELECT_LSB | minDeselect << QMI_M1_TIMING_MIN_DESELECT_LSB |
-                          clockDivider << QMI_M1_TIMING_CLKDIV_LSB;
+static uint32_t qmi_cal_ref[QMI_CAL_WORDS];
+
+// Changing timing under an XIP transfer (including its cooldown) isn't safe;
+// the direct-mode BUSY flag says when the last one has finished.
+static void __no_inline_not_in_flash_func(qmi_cal_set_timing)(int cs, uint32_t timing) {
+    hw_set_bits(&qmi_hw->direct_csr, QMI_DIRECT_CSR_EN_BITS);
+    while ((qmi_hw->direct_csr & QMI_DIRECT_CSR_BUSY_BITS) != 0)
+        ;
+    qmi_hw->m[cs].timing = timing;
+    hw_clear_bits(&qmi_hw->direct_csr, QMI_DIRECT_CSR_EN_BITS);
+}
+
+static bool __no_inline_not_in_flash_func(qmi_cal_check)(const volatile uint32_t *mem) {
+    for (int pass = 0; pass < QMI_CAL_PASSES; pass++) {
+        for (int i = 0; i < QMI_CAL_WORDS; i++) {
+            if (mem[i] != qmi_cal_ref[i])
+                return false;
+        }
+    }
+    return true;
+}
+
+// Returns the fastest passing timing for chip select cs, or its current
+// timing if nothing passes.  Runs with interrupts off, and must not touch
+// flash (while cs == 0, flash reads may return garbage).
+static uint32_t __no_inline_not_in_flash_func(qmi_cal_sweep)(int cs, const volatile uint32_t *mem,
+                                                             uint32_t sys_hz, uint32_t max_sck_hz) {
+    const uint32_t timing = qmi_hw->m[cs].timing;
+    const uint32_t base = timing & ~(QMI_M0_TIMING_CLKDIV_BITS | QMI_M0_TIMING_RXDELAY_BITS);
+    const uint cur_div = (timing & QMI_M0_TIMING_CLKDIV_BITS) >> QMI_M0_TIMING_CLKDIV_LSB;
+    const uint max_rx = QMI_M0_TIMING_RXDELAY_BITS >> QMI_M0_TIMING_RXDELAY_LSB;
+    uint min_div = (sys_hz + max_sck_hz - 1) / max_sck_hz;
+    uint32_t best = timing;
+    bool found = false;
+
+    if (min_div < 1)
+        min_div = 1;
+
+    for (uint div = min_div; div <= cur_div && !found; div++) {
+        int run_first = 0, run_len = 0, win_first = 0, win_len = 0;
+
+        for (uint rx = 0; rx <= max_rx; rx++) {
+            qmi_cal_set_timing(cs, base | div << QMI_M0_TIMING_CLKDIV_LSB |
+                                   rx << QMI_M0_TIMING_RXDELAY_LSB);
+            if (qmi_cal_check(mem)) {
+                if (run_len++ == 0)
+                    run_first = rx;
+                if (run_len > win_len) {
+                    win_first = run_first;
+                    win_len = run_len;
+                }
+            } else {
+                run_len = 0;
+            }
+        }
+        if (win_len >= QMI_CAL_MIN_WINDOW) {
+            best = base | div << QMI_M0_TIMING_CLKDIV_LSB |
+                (win_first + (win_len - 1) / 2) << QMI_M0_TIMING_RXDELAY_LSB;
+            found = true;
+        }
+    }
+    qmi_cal_set_timing(cs, best);
+    return best;
+}
+
+static void qmi_cal_report(const char *what, uint32_t before, uint32_t after, uint32_t sys_hz) {
+    uint div = (after & QMI_M0_TIMING_CLKDIV_BITS) >> QMI_M0_TIMING_CLKDIV_LSB;
+
+    printf("QMI %s timing: %08x -> %08x (%u MHz SCK, rxdelay %u)\n", what,
+           (unsigned)before, (unsigned)after, (unsigned)(sys_hz / div / 1000000),
+           (unsigned)((after & QMI_M0_TIMING_RXDELAY_BITS) >> QMI_M0_TIMING_RXDELAY_LSB));
+}
+
+// Calibrates both chip selects at the current clk_sys
+static void __no_inline_not_in_flash_func(qmi_calibrate_here)(const void *flash_test, bool psram) {
+    uint32_t sys_hz = (uint32_t)clock_get_hz(clk_sys);
+    const volatile uint32_t *flash_mem = (const volatile uint32_t *)
+        ((((uintptr_t)flash_test + 3) & ~3u) + QMI_NOCACHE_OFFSET);
+    volatile uint32_t *psram_mem = (volatile uint32_t *)(XIP_NOCACHE_NOALLOC_BASE + 0x01000000);
+    uint32_t m0_before = qmi_hw->m[0].timing;
+    uint32_t m1_before = qmi_hw->m[1].timing;
+    uint32_t m0_after, m1_after = m1_before;
+
+    uint32_t intr_stash = save_and_disable_interrupts();
+
+    if (psram) {
+        // The pattern toggles every data line between consecutive words.
+        // It's written at the current (known good) timing.
+        for (int i = 0; i < QMI_CAL_WORDS; i++) {
+            qmi_cal_ref[i] = (i * 0x9e3779b9u) ^ ((i & 1) ? 0xffffffffu : 0);
+            psram_mem[i] = qmi_cal_ref[i];
+        }
+        m1_after = qmi_cal_sweep(1, psram_mem, sys_hz, RP2350_PSRAM_MAX_SCK_HZ);
+
+        // Writes use the new divider too, so check they work
+        for (int i = 0; i < QMI_CAL_WORDS; i++) {
+            qmi_cal_ref[i] = ~qmi_cal_ref[i];
+            psram_mem[i] = qmi_cal_ref[i];
+        }
+        if (!qmi_cal_check(psram_mem)) {
+            qmi_cal_set_timing(1, m1_before);
+            m1_after = m1_before;
+        }
+    }
+
+    for (int i = 0; i < QMI_CAL_WORDS; i++)
+        qmi_cal_ref[i] = flash_mem[i];
+    m0_after = qmi_cal_sweep(0, flash_mem, sys_hz, RP2350_FLASH_MAX_SCK_HZ);
 
     restore_interrupts(intr_stash);
+
+    qmi_cal_report("flash", m0_before, m0_after, sys_hz);
+    if (psram)
+        qmi_cal_report("PSRAM", m1_before, m1_after, sys_hz);
+}
+
+// Joint clock planning
+//
+// clk_usb needs exactly 48MHz, and clk_hstx exactly half the DVI bit clock,
+// each from an integer division of one of the two PLLs.  clk_sys should be
+// as fast as possible without exceeding the target, and PSRAM runs at the
+// fastest integer division of clk_sys within its rated SCK.  The planner
+// tries every VCO and post-divider setting of both PLLs, and either PLL as
+// the source of clk_sys and of clk_hstx.
+
+#define PLL_VCO_MIN_HZ (750 * MHZ)
+#define PLL_VCO_MAX_HZ (1600 * MHZ)
+#define PLL_POSTDIV_MAX 7
+#define CLK_PERI_MAX_HZ (150 * MHZ)
+#define CLK_USB_DIV_MAX 15
+#define CLK_HSTX_DIV_MAX 3
+
+struct pll_setting {
+    uint32_t vco_hz;
+    uint8_t pd1, pd2;
+};
+
+struct clock_plan {
+    struct pll_setting usb, sys;
+    bool sys_from_usb;      // Otherwise from the sys PLL
+    bool hstx_from_usb;
+    uint32_t sys_hz;
+    uint32_t hstx_hz;
+    uint32_t psram_div;
+};
+
+static inline uint32_t pll_out_hz(const struct pll_setting *pll) {
+    return pll->vco_hz / (pll->pd1 * pll->pd2);
 }
 
+// Fastest integer division of src_hz that doesn't exceed max_hz
+static inline uint32_t clock_div_for(uint32_t src_hz, uint32_t max_hz) {
+    return (src_hz + max_hz - 1) / max_hz;
+}
 
-static void __no_inline_not_in_flash_func(clock_init)(int sys_clk_div) {
+static inline uint32_t best_sys_hz(uint32_t src_hz, uint32_t target_hz) {
+    return src_hz / clock_div_for(src_hz, target_hz);
+}
+
+static inline bool hstx_ok(uint32_t src_hz, uint32_t hstx_hz) {
+    return src_hz % hstx_hz == 0 && src_hz / hstx_hz <= CLK_HSTX_DIV_MAX;
+}
+
+// Enumerates PLL settings whose output is an exact number of Hz.  Returns
+// false once all have been visited.
+static bool pll_next(struct pll_setting *pll) {
+    uint fbdiv = pll->vco_hz / XOSC_HZ;
+
+    do {
+        if (pll->vco_hz == 0) {
+            fbdiv = (PLL_VCO_MIN_HZ + XOSC_HZ - 1) / XOSC_HZ;
+            pll->pd1 = pll->pd2 = 1;
+        } else if (pll->pd2 < pll->pd1) {
+            pll->pd2++;
+        } else if (pll->pd1 < PLL_POSTDIV_MAX) {
+            pll->pd1++;
+            pll->pd2 = 1;
+        } else {
+            fbdiv++;
+            pll->pd1 = pll->pd2 = 1;
+        }
+        pll->vco_hz = fbdiv * XOSC_HZ;
+        if (pll->vco_hz > PLL_VCO_MAX_HZ)
+            return false;
+    } while (pll->vco_hz % (pll->pd1 * pll->pd2) != 0);
+    return true;
+}
+
+// Between PLL settings giving the same clock, prefer the lower output
+// frequency (less power), then the higher VCO (less jitter).
+static bool pll_better(const struct pll_setting *a, const struct pll_setting *b) {
+    if (pll_out_hz(a) != pll_out_hz(b))
+        return pll_out_hz(a) < pll_out_hz(b);
+    return a->vco_hz > b->vco_hz;
+}
+
+static bool plan_better(const struct clock_plan *a, const struct clock_plan *b) {
+    if (a->sys_hz != b->sys_hz)
+        return a->sys_hz > b->sys_hz;
+    // Same clk_sys: prefer the faster PSRAM clock
+    uint32_t a_psram = a->sys_hz / a->psram_div, b_psram = b->sys_hz / b->psram_div;
+    if (a_psram != b_psram)
+        return a_psram > b_psram;
+    return pll_better(&a->usb, &b->usb);
+}
+
+static bool clock_plan(uint32_t sys_target_hz, uint32_t hstx_hz, uint32_t psram_max_hz,
+                       struct clock_plan *plan) {
+    struct pll_setting pll = { 0 };
+    // Best clk_sys from the sys PLL, with and without it also feeding HSTX,
+    // and the best sys PLL setting for feeding only HSTX
+    struct pll_setting sys_any = { 0 }, sys_hstx = { 0 }, hstx_only = { 0 };
+    uint32_t sys_any_hz = 0, sys_hstx_hz = 0;
+
+    while (pll_next(&pll)) {
+        uint32_t out = pll_out_hz(&pll);
+        uint32_t hz = best_sys_hz(out, sys_target_hz);
+
+        if (hz > sys_any_hz || (hz == sys_any_hz && pll_better(&pll, &sys_any))) {
+            sys_any = pll;
+            sys_any_hz = hz;
+        }
+        if ((hz > sys_hstx_hz || (hz == sys_hstx_hz && pll_better(&pll, &sys_hstx))) &&
+            hstx_ok(out, hstx_hz)) {
+            sys_hstx = pll;
+            sys_hstx_hz = hz;
+        }
+        if (hstx_ok(out, hstx_hz) && (hstx_only.vco_hz == 0 || pll_better(&pll, &hstx_only)))
+            hstx_only = pll;
+    }
+
+    bool found = false;
+    pll.vco_hz = 0;
+    while (pll_next(&pll)) {
+        uint32_t usb_out = pll_out_hz(&pll);
+        uint32_t usb_sys_hz = best_sys_hz(usb_out, sys_target_hz);
+
+        if (usb_out % (USB_CLK_KHZ * KHZ) != 0 || usb_out / (USB_CLK_KHZ * KHZ) > CLK_USB_DIV_MAX)
+            continue;
+
+        for (int hstx_from_usb = 0; hstx_from_usb <= 1; hstx_from_usb++) {
+            struct clock_plan p = { .usb = pll, .hstx_from_usb = hstx_from_usb, .hstx_hz = hstx_hz };
+
+            if (hstx_from_usb) {
+                if (!hstx_ok(usb_out, hstx_hz))
+                    continue;
+                p.sys = sys_any;
+                p.sys_hz = sys_any_hz;
+            } else {
+                if (sys_hstx_hz == 0)
+                    continue;
+                p.sys = sys_hstx;
+                p.sys_hz = sys_hstx_hz;
+            }
+            if (usb_sys_hz >= p.sys_hz) {
+                p.sys_from_usb = true;
+                p.sys_hz = usb_sys_hz;
+                if (!hstx_from_usb)
+                    p.sys = hstx_only;
+            }
+            p.psram_div = clock_div_for(p.sys_hz, psram_max_hz);
+            if (!found || plan_better(&p, plan)) {
+                *plan = p;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+static void clock_plan_report(const struct clock_plan *p) {
+    const struct pll_setting *sys_pll = p->sys_from_usb ? &p->usb : &p->sys;
+    const struct pll_setting *hstx_pll = p->hstx_from_usb ? &p->usb : &p->sys;
+
+    printf("Clock plan: clk_sys %u kHz = %s PLL (VCO %u MHz /%u/%u) /%u\n",
+           (unsigned)(p->sys_hz / KHZ), p->sys_from_usb ? "USB" : "sys",
+           (unsigned)(sys_pll->vco_hz / MHZ), sys_pll->pd1, sys_pll->pd2,
+           (unsigned)(pll_out_hz(sys_pll) / p->sys_hz));
+    printf("            clk_hstx %u kHz = %s PLL (VCO %u MHz /%u/%u) /%u\n",
+           (unsigned)(p->hstx_hz / KHZ), p->hstx_from_usb ? "USB" : "sys",
+           (unsigned)(hstx_pll->vco_hz / MHZ), hstx_pll->pd1, hstx_pll->pd2,
+           (unsigned)(pll_out_hz(hstx_pll) / p->hstx_hz));
+    printf("            PSRAM SCK %u kHz = clk_sys /%u\n",
+           (unsigned)(p->sys_hz / p->psram_div / KHZ), (unsigned)p->psram_div);
+}
+
+static void __no_inline_not_in_flash_func(clock_init)(const struct clock_plan *plan) {
     uint32_t intr_stash = save_and_disable_interrupts();
 
     // Before messing with clock speeds ensure QSPI clock is nice and slow
@@ -100,36 +421,44 @@ static void __no_inline_not_in_flash_func(clock_init)(int sys_clk_div) {
     clock_stop(clk_peri);
     clock_stop(clk_hstx);
 
-    // Set USB PLL to 528MHz
-    pll_init(pll_usb, PLL_COMMON_REFDIV, 1584 * MHZ, 3, 1);
-
-    const uint32_t usb_pll_freq = 528 * MHZ;
-
-    // CLK SYS = PLL USB 528MHz / sys_clk_div = 264MHz, 176MHz, or 132MHz
-    clock_configure(clk_sys,
-                    CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
-                    CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
-                    usb_pll_freq, usb_pll_freq / sys_clk_div);
-
-    // CLK PERI = PLL USB 528MHz / 4 = 132MHz
-    clock_configure(clk_peri,
-                    0, // Only AUX mux on ADC
-                    CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
-                    usb_pll_freq, usb_pll_freq / 4);
-
-    // CLK USB = PLL USB 528MHz / 11 = 48MHz
-    clock_configure(clk_usb,
-                    0, // No GLMUX
-                    CLOCKS_CLK_USB_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
-                    usb_pll_freq,
-                    USB_CLK_KHZ * KHZ);
-
-    // CLK ADC = PLL USB 528MHz / 11 = 48MHz
-    clock_configure(clk_adc,
-                    0, // No GLMUX
-                    CLOCKS_CLK_ADC_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
-                    usb_pll_freq,
-                    USB_CLK_KHZ * KHZ);
+    pll_init(pll_usb, PLL_COMMON_REFDIV, plan->usb.vco_hz, plan->usb.pd1, plan->usb.pd2);
+    pll_init(pll_sys, PLL_COMMON_REFDIV, plan->sys.vco_hz, plan->sys.pd1, plan->sys.pd2);
+
+    const uint32_t usb_pll_freq = pll_out_hz(&plan->usb);
+    const uint32_t sys_pll_freq = pll_out_hz(&plan->sys);
+
+    clock_configure_int_divider(clk_sys,
+                                CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
+                                plan->sys_from_usb ? CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB :
+                                                     CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS,
+                                plan->sys_from_usb ? usb_pll_freq : sys_pll_freq,
+                                (plan->sys_from_usb ? usb_pll_freq : sys_pll_freq) / plan->sys_hz);
+
+    // CLK PERI = PLL USB / n, as fast as allowed
+    clock_configure_int_divider(clk_peri,
+                                0, // Only AUX mux on ADC
+                                CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+                                usb_pll_freq, clock_div_for(usb_pll_freq, CLK_PERI_MAX_HZ));
+
+    // CLK USB = PLL USB / n = 48MHz
+    clock_configure_int_divider(clk_usb,
+                                0, // No GLMUX
+                                CLOCKS_CLK_USB_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+                                usb_pll_freq, usb_pll_freq / (USB_CLK_KHZ * KHZ));
+
+    // CLK ADC = PLL USB / n = 48MHz
+    clock_configure_int_divider(clk_adc,
+                                0, // No GLMUX
+                                CLOCKS_CLK_ADC_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+                                usb_pll_freq, usb_pll_freq / (USB_CLK_KHZ * KHZ));
+
+    // CLK HSTX = exactly half the DVI bit clock
+    clock_configure_int_divider(clk_hstx,
+                                0,
+                                plan->hstx_from_usb ? CLOCKS_CLK_HSTX_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB :
+                                                      CLOCKS_CLK_HSTX_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS,
+                                plan->hstx_from_usb ? usb_pll_freq : sys_pll_freq,
+                                (plan->hstx_from_usb ? usb_pll_freq : sys_pll_freq) / plan->hstx_hz);
 
     // Now we are running fast set fast QSPI clock and read delay
     set_qmi_timing();
@@ -137,10 +466,33 @@ static void __no_inline_not_in_flash_func(clock_init)(int sys_clk_div) {
     restore_interrupts(intr_stash);
 }
 
+// The plan overclock() last applied, for clock_set_sys_speed()
+static struct clock_plan current_plan;
+static enum clk_sys_speed current_speed;
+
+// QMI M0 (flash) and M1 (PSRAM) timing for each tier.  Flash keeps the
+// same dividers, so is only slower at lower tiers; PSRAM's cycle counts
+// are worked out per tier.  qmi_calibrate() refines both.
+static uint32_t tier_qmi_timing[CLK_SYS_132MHZ + 1][2];
+
 void overclock(enum clk_sys_speed clk_sys_div, uint32_t bit_clk_khz) {
-    clock_init(clk_sys_div);
+    struct clock_plan plan;
+    const uint32_t dvi_clock_hz = bit_clk_khz * KHZ / 2;
+
+    if (!clock_plan(CLK_SYS_TIER_BASE_HZ / clk_sys_div, dvi_clock_hz, RP2350_PSRAM_MAX_SCK_HZ, &plan))
+        panic("No clock plan for clk_sys %u kHz with HSTX at %u kHz",
+              CLK_SYS_TIER_BASE_HZ / clk_sys_div / KHZ, dvi_clock_hz / KHZ);
+    clock_init(&plan);
+    current_plan = plan;
+    current_speed = clk_sys_div;
 	stdio_init_all();
+    clock_plan_report(&plan);
     set_psram_timing();
+    for (uint t = CLK_SYS_264MHZ; t <= CLK_SYS_132MHZ; t++) {
+        tier_qmi_timing[t][0] = qmi_hw->m[0].timing;
+        tier_qmi_timing[t][1] = psram_timing_for(CLK_SYS_TIER_BASE_HZ / t);
+    }
+    tier_qmi_timing[clk_sys_div][1] = qmi_hw->m[1].timing;
 #define SHOW_CLK(i) printf("clk_get_hz(%s) -> %u\n", #i, clock_get_hz(i));
         SHOW_CLK(clk_gpout0);
         SHOW_CLK(clk_gpout1);
@@ -152,21 +504,117 @@ void overclock(enum clk_sys_speed clk_sys_div, uint32_t bit_clk_khz) {
         SHOW_CLK(clk_hstx);
         SHOW_CLK(clk_usb);
         SHOW_CLK(clk_adc);
+}
+
+// Dynamic clk_sys scaling
+//
+// Moves clk_sys to another tier by writing only its divider from the
+// planned PLL, so clk_hstx, clk_usb and clk_peri are untouched.  The PIO
+// state machines run from clk_sys, so their dividers are rescaled to keep
+// (e.g.) PIO USB and I2S at the same rate; a tier is refused if that can't
+// be done to within 0.1%.  The QMI timing is switched to the tier's at the
+// same time.  The core voltage goes up before speeding up,
+// and down after slowing down.  Tiers faster than overclock()'s plan (the
+// one that passed the self-test) are refused too.
+
+#define PIO_DIV_MAX_ERROR 1000 // i.e. 1/1000
+#define VREG_SETTLE_US 1000
+
+static enum vreg_voltage sys_voltage(uint32_t sys_hz) {
+    return sys_hz > 150 * MHZ ? VREG_VOLTAGE_1_15 : VREG_VOLTAGE_1_10;
+}
+
+static bool pio_rescale(uint32_t old_hz, uint32_t new_hz, bool apply) {
+    for (uint p = 0; p < NUM_PIOS; p++) {
+        PIO pio = pio_get_instance(p);
+
+        for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; sm++) {
+            if (!(pio->ctrl & (1u << (PIO_CTRL_SM_ENABLE_LSB + sm))))
+                continue;
+            // 16.8 fixed point
+            uint64_t div = pio->sm[sm].clkdiv >> PIO_SM0_CLKDIV_FRAC_LSB;
+            uint64_t want = div * new_hz;
+            uint64_t scaled = (want + old_hz / 2) / old_hz;
+            uint64_t got = scaled * old_hz;
+            uint64_t error = got > want ? got - want : want - got;
+
+            if (scaled < 256 || scaled > 0xffffff || error * PIO_DIV_MAX_ERROR > want)
+                return false;
+            if (apply)
+                pio->sm[sm].clkdiv = (uint32_t)scaled << PIO_SM0_CLKDIV_FRAC_LSB;
+        }
+    }
+    return true;
+}
+
+// Only the divider changes.  clock_configure() would also switch clk_sys to
+// clk_ref and back through the glitchless mux, i.e. run at 12MHz meanwhile.
+// RXDELAY and the PSRAM cycle counts are in clk_sys cycles, so the QMI
+// timing changes along with it, with XIP stalled (as for calibration).
+static void __no_inline_not_in_flash_func(clock_sys_set_div)(uint32_t div, const uint32_t *qmi_timing) {
+    hw_set_bits(&qmi_hw->direct_csr, QMI_DIRECT_CSR_EN_BITS);
+    while ((qmi_hw->direct_csr & QMI_DIRECT_CSR_BUSY_BITS) != 0)
+        ;
+    clocks_hw->clk[clk_sys].div = div << CLOCKS_CLK_SYS_DIV_INT_LSB;
+    qmi_hw->m[0].timing = qmi_timing[0];
+    qmi_hw->m[1].timing = qmi_timing[1];
+    hw_clear_bits(&qmi_hw->direct_csr, QMI_DIRECT_CSR_EN_BITS);
+}
+
+bool clock_set_sys_speed(enum clk_sys_speed speed) {
+    const struct clock_plan *plan = &current_plan;
+    const uint32_t old_hz = clock_get_hz(clk_sys);
+    const uint32_t new_hz = CLK_SYS_TIER_BASE_HZ / speed;
+
+    if (plan->sys_hz == 0)
+        return false; // Not overclocked, so no plan
+    if (new_hz == old_hz)
+        return true;
+
+    const uint32_t src_hz = pll_out_hz(plan->sys_from_usb ? &plan->usb : &plan->sys);
+    if (new_hz > plan->sys_hz || src_hz % new_hz != 0 || !pio_rescale(old_hz, new_hz, false))
+        return false;
 
+    if (new_hz > old_hz) {
+        vreg_set_voltage(sys_voltage(new_hz));
+        busy_wait_us(VREG_SETTLE_US);
+    }
 
-    const uint32_t dvi_clock_khz = bit_clk_khz >> 1;
-printf("bit_clk_khz = %u dvi_clock_khz = %u\n", bit_clk_khz, dvi_clock_khz);
-    uint vco_freq, post_div1, post_div2;
-    if (!check_sys_clock_khz(dvi_clock_khz, &vco_freq, &post_div1, &post_div2))
-        panic("System clock of %u kHz cannot be exactly achieved", dvi_clock_khz);
-    const uint32_t freq = vco_freq / (post_div1 * post_div2);
+    uint32_t intr_stash = save_and_disable_interrupts();
+    clock_sys_set_div(src_hz / new_hz, tier_qmi_timing[speed]);
+    pio_rescale(old_hz, new_hz, true);
+    restore_interrupts(intr_stash);
+    clock_set_reported_hz(clk_sys, new_hz);
+    current_speed = speed;
 
-    // Set the sys PLL to the requested freq
-    pll_init(pll_sys, PLL_COMMON_REFDIV, vco_freq, post_div1, post_div2);
+    if (new_hz < old_hz)
+        vreg_set_voltage(sys_voltage(new_hz));
+    return true;
+}
 
-    // CLK HSTX = Requested freq
-    clock_configure(clk_hstx,
-                    0,
-                    CLOCKS_CLK_HSTX_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS,
-                    freq, freq);
+// Must be called with the other core not running from flash.  flash_test is
+// QMI_CAL_WORDS words of varied data in flash (e.g. the Mac ROM image).
+// With USE_DVFS, each tier clock_set_sys_speed() can use is calibrated in
+// turn, before going back to the current one.
+void qmi_calibrate(const void *flash_test, bool psram) {
+    const enum clk_sys_speed speed = current_speed;
+
+    if (current_plan.sys_hz == 0) {
+        qmi_calibrate_here(flash_test, psram);
+        return;
+    }
+#if USE_DVFS
+    for (uint t = CLK_SYS_264MHZ; t <= CLK_SYS_132MHZ; t++) {
+        if (t != speed && !clock_set_sys_speed(t))
+            continue;
+        qmi_calibrate_here(flash_test, psram);
+        tier_qmi_timing[t][0] = qmi_hw->m[0].timing;
+        tier_qmi_timing[t][1] = qmi_hw->m[1].timing;
+    }
+    clock_set_sys_speed(speed);
+#else
+    qmi_calibrate_here(flash_test, psram);
+    tier_qmi_timing[speed][0] = qmi_hw->m[0].timing;
+    tier_qmi_timing[speed][1] = qmi_hw->m[1].timing;
+#endif
 }
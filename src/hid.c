@@ -25,6 +25,7 @@
  */
 
 #include "bsp/rp2040/boards/adafruit_fruit_jam/board.h"
+#include "hardware/sync.h"
 #include "tusb.h"
 
 #include "kbd.h"
@@ -120,6 +121,8 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
                 process_generic_report(dev_addr, instance, report, len);
                 break;
         }
+        /* Wake core 1, in case it's sleeping while the guest is idle */
+        __sev();
 
         // continue to request to receive report
         if ( !tuh_hid_receive_report(dev_addr, instance) )
@@ -142,6 +145,29 @@ static inline bool find_key_in_report(hid_keyboard_report_t const *report, uint8
         return false;
 }
 
+/* Ctrl-Option-F1..F4 select the 68K speed: 1x, 2x, 4x of a real Mac, or
+ * as fast as possible.  These keys aren't passed on.
+ */
+extern volatile int umac_cpu_speed;
+
+static bool is_hotkey(uint8_t modifier, uint8_t keycode)
+{
+        uint8_t mods = (modifier | (modifier >> 4)) & 0xf;
+
+        return (mods & 5) == 5 && keycode >= HID_KEY_F1 && keycode <= HID_KEY_F4;
+}
+
+static void process_hotkey(uint8_t keycode)
+{
+        static const int speeds[] = { 1, 2, 4, 0 };
+
+        umac_cpu_speed = speeds[keycode - HID_KEY_F1];
+        if (umac_cpu_speed)
+                printf("CPU speed: %dx\n", umac_cpu_speed);
+        else
+                printf("CPU speed: unthrottled\n");
+}
+
 static void process_kbd_report(hid_keyboard_report_t const *report)
 {
         /* Previous report is stored to compare against for key release: */
@@ -151,12 +177,15 @@ static void process_kbd_report(hid_keyboard_report_t const *report)
                 if (report->keycode[i]) {
                         if (find_key_in_report(&prev_report, report->keycode[i])) {
                                 /* Key held */
+                        } else if (is_hotkey(report->modifier, report->keycode[i])) {
+                                process_hotkey(report->keycode[i]);
                         } else {
                                 /* printf("Key pressed: %02x\n", report->keycode[i]); */
                                 kbd_queue_push(report->keycode[i], true);
                         }
                 }
-                if (prev_report.keycode[i] && !find_key_in_report(report, prev_report.keycode[i])) {
+                if (prev_report.keycode[i] && !find_key_in_report(report, prev_report.keycode[i]) &&
+                    !is_hotkey(prev_report.modifier, prev_report.keycode[i])) {
                         /* printf("Key released: %02x\n", prev_report.keycode[i]); */
                         kbd_queue_push(prev_report.keycode[i], false);
                 }
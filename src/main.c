@@ -30,9 +30,11 @@
 #include <unistd.h>
 #include <string.h>
 #include "hardware/clocks.h"
+#include "hardware/dma.h"
 #include "hardware/gpio.h"
 #include "hardware/pio.h"
 #include "hardware/sync.h"
+#include "hardware/watchdog.h"
 #include "pico/multicore.h"
 #include "pico/stdlib.h"
 #include "pico/time.h"
@@ -45,6 +47,9 @@
 #include "tusb.h"
 
 #include "umac.h"
+#if USE_IDLE_SLEEP
+#include "m68k.h"
+#endif
 #include "clocking.h"
 
 #if USE_SD
@@ -57,6 +62,9 @@
 #if USE_PSRAM
 #include "hardware/structs/qmi.h"
 #include "hardware/structs/xip.h"
+#if USE_FB_DMA
+#include "hardware/xip_cache.h"
+#endif
 #endif
 
 #if ENABLE_AUDIO
@@ -64,7 +72,7 @@
 #include "hardware/i2c.h"
 uint8_t *audio_base;
 static void audio_setup();
-static bool audio_poll();
+static void audio_poll();
 static void set_mute_state(bool new_state);
 static absolute_time_t automute_time;
 #endif
@@ -77,6 +85,11 @@ extern int cursor_x;
 extern int cursor_y;
 extern int cursor_button;
 
+/* 68K speed as a multiple of a real Mac's, or 0 for as fast as possible.
+ * Changed at runtime by hid.c's hotkeys.
+ */
+volatile int umac_cpu_speed = CPU_SPEED;
+
 // Mac binary data:  disc and ROM images
 static const uint8_t umac_disc[] = {
 #include "umac-disc.h"
@@ -91,9 +104,15 @@ static const uint8_t umac_rom[] = {
 static uint8_t umac_ram[RAM_SIZE];
 #endif
 
-#define MIRROR_FRAMEBUFFER (USE_PSRAM || DISP_WIDTH != 640)
+/* Video scans out the DISP_WIDTH x DISP_HEIGHT framebuffer directly,
+ * adding any borders itself.  With PSRAM, video streams the rows through
+ * line buffers (USE_PSRAM_SCANOUT); otherwise the guest's screen is
+ * mirrored into SRAM so that scanout doesn't contend with (or miss in)
+ * the XIP cache.
+ */
+#define MIRROR_FRAMEBUFFER (USE_PSRAM && !USE_PSRAM_SCANOUT)
 #if MIRROR_FRAMEBUFFER
-static uint32_t umac_framebuffer_mirror[640*480/32];
+static uint32_t umac_framebuffer_mirror[DISP_WIDTH*DISP_HEIGHT/32];
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -119,64 +138,482 @@ static int umac_cursor_y = 0;
 static int umac_cursor_button = 0;
 
 #define umac_get_audio_offset() (RAM_SIZE - 768)
+
+/* Emulated time:  umac_loop() runs a fixed quantum of 68K cycles,
+ * UMAC_EXECLOOP_QUANTUM, which CMakeLists.txt takes from umac's source.
+ */
+#ifndef UMAC_EXECLOOP_QUANTUM
+#error "UMAC_EXECLOOP_QUANTUM should be set by the build, from umac"
+#endif
+#define MAC_CLOCK_HZ            7833600
+#define MAC_CYCLES_PER_FRAME    (MAC_CLOCK_HZ / 60)
+#define FRAME_LOOPS_REALTIME    (MAC_CYCLES_PER_FRAME / UMAC_EXECLOOP_QUANTUM)
+
+/* umac_loop() calls since vsync, and whether core 1 has waited since then
+ * (the guest idle, or paced by the speed governor):
+ */
+static unsigned int frame_loops;
+static bool frame_waited;
+
+/* A frame is late, i.e. the emulator is behind real time, if it ran fewer
+ * 68K cycles than the selected speed needs (1x if unthrottled) without
+ * waiting.  A short frame that waited had time to spare.
+ */
+static inline bool      frame_late()
+{
+        int speed = umac_cpu_speed;
+
+        return frame_loops < FRAME_LOOPS_REALTIME * (speed ? speed : 1) && !frame_waited;
+}
+
+#if SHOW_STATS
+/* Counters accumulated over a second, printed from the 1Hz event: */
+static struct {
+        unsigned int    loops;
+        unsigned int    frames;
+        unsigned int    frames_skipped;
+        unsigned int    idle_us;
+#if USE_FB_DMA
+        unsigned int    fb_copies;
+        unsigned int    fb_rows_copied;
+#endif
+} stats;
+/* video_irq_us at the last 1Hz event (the IRQ owns the counter): */
+static unsigned int stats_video_irq_us;
+#endif
+
+#if PROFILE_HANDLERS
+/* m68kops.c is built with -finstrument-functions, so every opcode
+ * handler call lands here.  Calls are counted per handler address, and
+ * the table is dumped periodically for hot-handlers.py to turn into a
+ * HOT_HANDLERS list (see README).
+ */
+#define PROF_ENTRIES            4096    /* Power of 2, > number of handlers */
+#define PROF_DUMP_SECS          30
+
+static struct {
+        uintptr_t       fn;
+        uint32_t        count;
+} prof_table[PROF_ENTRIES];
+static unsigned int prof_secs;
+
+/* Called on entry to, and exit from, every function in m68kops.c: */
+void __no_inline_not_in_flash_func(__cyg_profile_func_enter)(void *fn, void *caller)
+{
+        uintptr_t f = (uintptr_t)fn;
+        unsigned int i = (f >> 1) & (PROF_ENTRIES - 1);
+
+        /* Open addressing; once full, new handlers just aren't counted */
+        for (unsigned int n = 0; n < PROF_ENTRIES; n++) {
+                if (prof_table[i].fn == f) {
+                        prof_table[i].count++;
+                        return;
+                }
+                if (prof_table[i].fn == 0) {
+                        prof_table[i].fn = f;
+                        prof_table[i].count = 1;
+                        return;
+                }
+                i = (i + 1) & (PROF_ENTRIES - 1);
+        }
+}
+
+void __no_inline_not_in_flash_func(__cyg_profile_func_exit)(void *fn, void *caller)
+{
+}
+
+static void     prof_dump()
+{
+        printf("prof: begin\n");
+        for (unsigned int i = 0; i < PROF_ENTRIES; i++) {
+                if (prof_table[i].fn)
+                        printf("prof: %08x %u\n", (unsigned int)prof_table[i].fn,
+                               (unsigned int)prof_table[i].count);
+        }
+        printf("prof: end\n");
+}
+#endif
+
 #if MIRROR_FRAMEBUFFER
+#define LONGS_PER_ROW (DISP_WIDTH / 32)
+
+/* The mirror is a plain copy: the Mac's 1=black inversion is done by the
+ * video output.
+ */
+static inline uint32_t *mirror_src_row(int row) {
+    return (uint32_t*)(umac_ram + umac_get_fb_offset()) + LONGS_PER_ROW * row;
+}
+
+static inline uint32_t *mirror_dest_row(int row) {
+    return umac_framebuffer_mirror + LONGS_PER_ROW * row;
+}
+
+#if USE_FB_DMA
+#if !PICO_RP2350
+#error "USE_FB_DMA needs an RP2350 (it uses DMA_IRQ_3)"
+#endif
+/* DMA framebuffer mirroring:
+ *
+ * Rather than core 1 copying the screen each vsync, DMA finds the rows
+ * that changed and copies them, with one IRQ per frame.  For each row in
+ * turn, four channels chain:
+ *
+ *  reset: writes the seed to the sniffer's CRC.
+ *  crc:   reads the row into a dummy word, the sniffer computing its
+ *         CRC32.  Its read address just carries on to the next row.
+ *  cap:   copies the CRC into the frame's fb_row_crc[], likewise.
+ *  kick:  writes the next entry of fb_dma_kicks[] to MULTI_CHAN_TRIGGER,
+ *         i.e. triggers reset for the next row, or copy after the last.
+ *
+ * copy is armed as a dummy transfer that raises DMA_IRQ_3.  The IRQ
+ * compares the CRCs with the previous frame's, and copy then sends the
+ * band from the first changed row to the last in one go.
+ *
+ * The rows are read through the uncached alias, so don't pollute the XIP
+ * cache.  The cache is write-back, though, so the guest's (i.e. core 1's)
+ * latest screen writes are cleaned out to PSRAM before each frame.
+ */
+#define FB_DMA_CRC_SEED         0xffffffff
+
+static uint8_t fb_dma_reset_ch;
+static uint8_t fb_dma_crc_ch;
+static uint8_t fb_dma_cap_ch;
+static uint8_t fb_dma_kick_ch;
+static uint8_t fb_dma_copy_ch;
+static uint32_t fb_dma_copy_ctrl;       /* The band copy */
+static uint32_t fb_dma_copy_ctrl_irq;   /* A dummy word, raising the IRQ */
+static uint32_t fb_dma_seed = FB_DMA_CRC_SEED;
+static uint32_t fb_dma_sink;
+/* Written 16 bits at a time, which the bus replicates into the top half
+ * of MULTI_CHAN_TRIGGER (where there are no channels):
+ */
+static uint16_t fb_dma_kicks[DISP_HEIGHT];
+static uint32_t fb_row_crc[2][DISP_HEIGHT];
+static int fb_row_crc_cur;              /* fb_row_crc[] being written */
+static volatile bool fb_dma_busy;       /* From vsync until the IRQ */
+static bool fb_dma_copy_all = true;     /* Copy regardless of CRC (first frame) */
+
+static inline const uint32_t *fb_dma_src_row(int row) {
+#if USE_PSRAM
+    /* Read through the uncached alias: */
+    return (const uint32_t *)((uintptr_t)mirror_src_row(row) + 0x04000000);
+#else
+    return mirror_src_row(row);
+#endif
+}
+
+static void __not_in_flash_func(fb_dma_irq)() {
+    dma_irqn_acknowledge_channel(3, fb_dma_copy_ch);
+
+    const uint32_t *crc = fb_row_crc[fb_row_crc_cur];
+    const uint32_t *last_crc = fb_row_crc[fb_row_crc_cur ^ 1];
+    int first = 0;
+    int last = DISP_HEIGHT - 1;
+
+    if (!fb_dma_copy_all) {
+        while (first < DISP_HEIGHT && crc[first] == last_crc[first])
+            first++;
+        while (last > first && crc[last] == last_crc[last])
+            last--;
+    }
+    fb_dma_copy_all = false;
+    fb_row_crc_cur ^= 1;
+#if SHOW_STATS
+    stats.fb_copies++;
+#endif
+
+    if (first < DISP_HEIGHT) {
+        dma_channel_hw_t *ch = dma_channel_hw_addr(fb_dma_copy_ch);
+        ch->read_addr = (uintptr_t)fb_dma_src_row(first);
+        ch->write_addr = (uintptr_t)mirror_dest_row(first);
+        ch->transfer_count = (last - first + 1) * LONGS_PER_ROW;
+        ch->ctrl_trig = fb_dma_copy_ctrl;
+#if SHOW_STATS
+        stats.fb_rows_copied += last - first + 1;
+#endif
+    }
+    fb_dma_busy = false;
+}
+
+static void fb_dma_init() {
+    fb_dma_reset_ch = dma_claim_unused_channel(true);
+    fb_dma_crc_ch = dma_claim_unused_channel(true);
+    fb_dma_cap_ch = dma_claim_unused_channel(true);
+    fb_dma_kick_ch = dma_claim_unused_channel(true);
+    fb_dma_copy_ch = dma_claim_unused_channel(true);
+
+    for (int i = 0; i < DISP_HEIGHT - 1; i++)
+        fb_dma_kicks[i] = 1u << fb_dma_reset_ch;
+    fb_dma_kicks[DISP_HEIGHT - 1] = 1u << fb_dma_copy_ch;
+
+    /* reset: seed -> SNIFF_DATA */
+    dma_channel_config c = dma_channel_get_default_config(fb_dma_reset_ch);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_chain_to(&c, fb_dma_crc_ch);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(fb_dma_reset_ch, &c, &dma_hw->sniff_data, &fb_dma_seed,
+                          1, false);
+
+    /* crc: row -> dummy word, sniffed */
+    c = dma_channel_get_default_config(fb_dma_crc_ch);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_sniff_enable(&c, true);
+    channel_config_set_chain_to(&c, fb_dma_cap_ch);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(fb_dma_crc_ch, &c, &fb_dma_sink, NULL,
+                          LONGS_PER_ROW, false);
+    dma_sniffer_enable(fb_dma_crc_ch, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, true);
+
+    /* cap: SNIFF_DATA -> fb_row_crc[][row] */
+    c = dma_channel_get_default_config(fb_dma_cap_ch);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_chain_to(&c, fb_dma_kick_ch);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(fb_dma_cap_ch, &c, NULL, &dma_hw->sniff_data,
+                          1, false);
+
+    /* kick: fb_dma_kicks[row] -> MULTI_CHAN_TRIGGER */
+    c = dma_channel_get_default_config(fb_dma_kick_ch);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(fb_dma_kick_ch, &c, &dma_hw->multi_channel_trigger, NULL,
+                          1, false);
+
+    /* copy: rows -> mirror, or the dummy word */
+    c = dma_channel_get_default_config(fb_dma_copy_ch);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    fb_dma_copy_ctrl_irq = channel_config_get_ctrl_value(&c);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_irq_quiet(&c, true);
+    fb_dma_copy_ctrl = channel_config_get_ctrl_value(&c);
+
+    dma_irqn_set_channel_enabled(3, fb_dma_copy_ch, true);
+    irq_set_exclusive_handler(DMA_IRQ_3, fb_dma_irq);
+    irq_set_enabled(DMA_IRQ_3, true);
+}
+
+/* Start mirroring a frame.  If the previous one hasn't finished (e.g. a
+ * vsync was delivered early) let it complete rather than restarting.
+ */
 static void copy_framebuffer() {
-    uint32_t *src = (uint32_t*)(umac_ram + umac_get_fb_offset());
-#if DISP_WIDTH==640 && DISP_HEIGHT==480
-    uint32_t *dest = umac_framebuffer_mirror;
-    for(int i=0; i<640*480/32; i++) {
+    if (fb_dma_busy || dma_channel_is_busy(fb_dma_copy_ch))
+        return;
+    fb_dma_busy = true;
+#if USE_PSRAM
+    xip_cache_clean_range((uintptr_t)mirror_src_row(0) - XIP_BASE,
+                          DISP_HEIGHT * LONGS_PER_ROW * sizeof(uint32_t));
+#endif
+
+    /* Arm copy (without triggering it) to raise the IRQ after the last row */
+    dma_channel_hw_t *ch = dma_channel_hw_addr(fb_dma_copy_ch);
+    ch->read_addr = (uintptr_t)&fb_dma_sink;
+    ch->write_addr = (uintptr_t)&fb_dma_sink;
+    ch->transfer_count = 1;
+    ch->al1_ctrl = fb_dma_copy_ctrl_irq;
+
+    dma_channel_set_read_addr(fb_dma_crc_ch, fb_dma_src_row(0), false);
+    dma_channel_set_write_addr(fb_dma_cap_ch, fb_row_crc[fb_row_crc_cur], false);
+    dma_channel_set_read_addr(fb_dma_kick_ch, fb_dma_kicks, false);
+    dma_channel_start(fb_dma_reset_ch);
+}
+#else
+static inline void copy_framebuffer_row(int row) {
+    uint32_t *src = mirror_src_row(row);
+    uint32_t *dest = mirror_dest_row(row);
+    for(int j=0; j<LONGS_PER_ROW; j++) {
         *dest++ = *src++;
     }
-#elif DISP_WIDTH==512 && DISP_HEIGHT==342
-    #define DISP_XOFFSET ((640 - DISP_WIDTH) / 32 / 2)
-    #define DISP_YOFFSET ((480 - DISP_HEIGHT) / 2)
-    #define LONGS_PER_INPUT_ROW (DISP_WIDTH / 32)
-    #define LONGS_PER_OUTPUT_ROW (640 / 32)
+}
+
+static void copy_framebuffer() {
     for(int i=0; i<DISP_HEIGHT; i++) {
-        uint32_t *dest = umac_framebuffer_mirror + (DISP_YOFFSET * LONGS_PER_OUTPUT_ROW + DISP_XOFFSET) + LONGS_PER_OUTPUT_ROW * i;
-        for(int j=0; j<LONGS_PER_INPUT_ROW; j++) {
-          *dest++ = *src++ ^ 0xffffffff;
-        }
+        copy_framebuffer_row(i);
     }
-#else
-#error Unsupported display geometry for framebuffer mirroring
+}
+#endif /* USE_FB_DMA */
+
+#if FRAME_SKIP_MAX
+/* Frame decimation:
+ *
+ * When the last frame was late (see frame_late(), e.g. during boot, or
+ * anything else keeping the 68K busy) the emulator is behind real time,
+ * so the mirror copy is skipped to give the time to the 68K instead.  A
+ * frame spent idle or paced isn't late, so isn't skipped.  At most
+ * FRAME_SKIP_MAX frames in a row are skipped, so the screen still updates.
+ * Vsync is delivered to the guest either way.
+ */
+
+static unsigned int frames_skipped;     /* Consecutive mirror copies skipped */
+
+static bool     mirror_skip_frame()
+{
+        if (frame_late() && frames_skipped < FRAME_SKIP_MAX) {
+                frames_skipped++;
+#if SHOW_STATS
+                stats.frames_skipped++;
 #endif
+                return true;
+        }
+        frames_skipped = 0;
+        return false;
 }
 #endif
+#endif /* MIRROR_FRAMEBUFFER */
 
-static void     poll_umac()
-{
-        static absolute_time_t last_1hz = 0;
-        static absolute_time_t last_vsync = 0;
-        absolute_time_t now = get_absolute_time();
+/* Event scheduling:
+ *
+ * umac_loop() runs in a tight batch until something needs doing: vsync
+ * (the video output having counted a frame), the earliest deadline of
+ * the 1Hz tick, input or audio, or (see below) the speed governor's
+ * budget running out or the guest going idle.  So per iteration, the
+ * only overhead is a load of video_frame_count and of the timer's low
+ * word.  Each event is dispatched only when due.
+ */
+#define INPUT_POLL_US           1000    /* HID reports come at most every 1ms */
+#define AUDIO_POLL_US           4000    /* A buffer lasts 16.6ms, and 3 are queued */
+
+#if USE_DVFS
+/* Dynamic frequency scaling:
+ *
+ * Every DVFS_FRAMES vsyncs, core 1's waiting time (guest idle, or paced by
+ * the speed governor) is checked.  If it waited more than DVFS_DOWN_PCT of
+ * the time and no frame was late, clk_sys steps down a tier.  If it waited
+ * less than DVFS_UP_PCT, or any frame was late, it steps back up, but no
+ * higher than the tier overclock_tested() settled on (see frame_late()).
+ * clock_set_sys_speed() keeps the video, USB and audio
+ * clocks where they were.
+ */
+#if !USE_IDLE_SLEEP
+#error "USE_DVFS needs USE_IDLE_SLEEP: unpaced, core 1 never waits otherwise"
+#endif
 
-        umac_loop();
+#define DVFS_FRAMES             15
+#define DVFS_DOWN_PCT           50
+#define DVFS_UP_PCT             10
 
-        int64_t p_1hz = absolute_time_diff_us(last_1hz, now);
-        int64_t p_vsync = absolute_time_diff_us(last_vsync, now);
-        bool pending_vsync = p_vsync > 16667;
-#if ENABLE_AUDIO
-        if (automute_time < now) {
-            automute_time = at_the_end_of_time;
-            set_mute_state(false);
+static enum clk_sys_speed dvfs_speed = CLK_SYS_264MHZ;
+static enum clk_sys_speed dvfs_top_speed = CLK_SYS_264MHZ;
+static unsigned int dvfs_frames;
+static unsigned int dvfs_late;
+static uint32_t dvfs_wait_us;
+static uint32_t dvfs_window_us;
+
+static void     dvfs_vsync()
+{
+        if (frame_late())
+                dvfs_late++;
+        if (++dvfs_frames < DVFS_FRAMES)
+                return;
+
+        uint32_t now = time_us_32();
+        unsigned int wait_pct = (uint64_t)dvfs_wait_us * 100 / ((now - dvfs_window_us) | 1);
+        enum clk_sys_speed want = dvfs_speed;
+
+        if ((dvfs_late || wait_pct < DVFS_UP_PCT) && dvfs_speed > dvfs_top_speed)
+                want = dvfs_speed - 1;
+        else if (!dvfs_late && wait_pct > DVFS_DOWN_PCT && dvfs_speed < CLK_SYS_132MHZ)
+                want = dvfs_speed + 1;
+        if (want != dvfs_speed && clock_set_sys_speed(want)) {
+                dvfs_speed = want;
+#if SHOW_STATS
+                printf("DVFS: clk_sys %u MHz (%u%% waiting, %u late)\n",
+                       (unsigned int)(clock_get_hz(clk_sys) / MHZ), wait_pct, dvfs_late);
+#endif
         }
+        dvfs_frames = 0;
+        dvfs_late = 0;
+        dvfs_wait_us = 0;
+        dvfs_window_us = now;
+}
 #endif
+
+static unsigned int last_vsync_frame;
+static uint32_t next_1hz_us;
+static uint32_t next_input_us;
 #if ENABLE_AUDIO
-        pending_vsync |= audio_poll();
+static uint32_t next_audio_us;
 #endif
-        if (pending_vsync) {
-#if MIRROR_FRAMEBUFFER
+
+static inline bool      deadline_due(uint32_t now, uint32_t deadline)
+{
+        return (int32_t)(now - deadline) >= 0;
+}
+
+static uint32_t         next_deadline()
+{
+        uint32_t d = next_1hz_us;
+        if ((int32_t)(next_input_us - d) < 0)
+                d = next_input_us;
+#if ENABLE_AUDIO
+        if ((int32_t)(next_audio_us - d) < 0)
+                d = next_audio_us;
+#endif
+        return d;
+}
+
+static void     umac_vsync()
+{
+#if MIRROR_FRAMEBUFFER && FRAME_SKIP_MAX
+        if (!mirror_skip_frame())
                 copy_framebuffer();
+#elif MIRROR_FRAMEBUFFER
+        copy_framebuffer();
+#endif
+        umac_vsync_event();
+#if USE_DVFS
+        dvfs_vsync();
+#endif
+        frame_loops = 0;
+        frame_waited = false;
+#if SHOW_STATS
+        stats.frames++;
 #endif
-                /* FIXME: Trigger this off actual vsync */
-                umac_vsync_event();
-                last_vsync = now;
+#if ENABLE_AUDIO
+        if (automute_time < get_absolute_time()) {
+                automute_time = at_the_end_of_time;
+                set_mute_state(false);
         }
-        if (p_1hz >= 1000000) {
-                umac_1hz_event();
-                last_1hz = now;
+#endif
+}
+
+static void     umac_1hz()
+{
+        umac_1hz_event();
+#if SHOW_STATS
+        if (stats.frames) {
+                printf("stats: %u umac loops, %u frames (%u skipped), %u%% idle, %u us video IRQ\n",
+                       stats.loops, stats.frames, stats.frames_skipped,
+                       stats.idle_us / 10000, video_irq_us - stats_video_irq_us);
+        }
+#if USE_FB_DMA
+        if (stats.fb_copies)
+                printf("stats: %u fb rows changed per copy\n",
+                       stats.fb_rows_copied / stats.fb_copies);
+#endif
+        memset(&stats, 0, sizeof(stats));
+        stats_video_irq_us = video_irq_us;
+#endif
+#if PROFILE_HANDLERS
+        if (++prof_secs == PROF_DUMP_SECS) {
+                prof_dump();
+                prof_secs = 0;
         }
+#endif
+}
 
+static void     umac_input()
+{
         int update = 0;
         int dx = 0;
         int dy = 0;
@@ -206,6 +643,206 @@ static void     poll_umac()
         }
 }
 
+/* Speed governor:
+ *
+ * With umac_cpu_speed non-zero, 68K cycles are paced against the timer:
+ * cpu_credit accrues umac_cpu_speed * MAC_CLOCK_HZ cycles a second, and
+ * each umac_loop() spends a quantum of it.  When there isn't enough for
+ * another, the core waits (in WFE) for the credit or the next deadline.
+ * Credit is capped at a frame's worth, so a stall (e.g. disc access)
+ * doesn't lead to a burst of catching up.
+ */
+static uint32_t cpu_credit;
+static uint32_t cpu_credit_us;
+
+static unsigned int     cpu_speed_budget(uint32_t now)
+{
+        int speed = umac_cpu_speed;
+        uint32_t elapsed = now - cpu_credit_us;
+
+        cpu_credit_us = now;
+        if (speed == 0)
+                return ~0u;
+
+        uint64_t credit = cpu_credit +
+                (uint64_t)elapsed * speed * MAC_CLOCK_HZ / 1000000;
+        uint32_t cap = speed * MAC_CYCLES_PER_FRAME;
+        cpu_credit = credit > cap ? cap : credit;
+        return cpu_credit / UMAC_EXECLOOP_QUANTUM;
+}
+
+static void     cpu_speed_charge(unsigned int loops)
+{
+        if (umac_cpu_speed)
+                cpu_credit -= loops * UMAC_EXECLOOP_QUANTUM;
+}
+
+/* Sleep until there's credit for another umac_loop(), or the deadline */
+static void     cpu_speed_wait(uint32_t now, uint32_t deadline)
+{
+        int speed = umac_cpu_speed;
+
+        if (speed == 0 || deadline_due(now, deadline))
+                return;
+        uint32_t wait = (uint64_t)(UMAC_EXECLOOP_QUANTUM - cpu_credit) * 1000000 /
+                ((uint64_t)speed * MAC_CLOCK_HZ) + 1;
+        if (deadline - now < wait)      /* deadline is in the future */
+                wait = deadline - now;
+        best_effort_wfe_or_timeout(make_timeout_time_us(wait));
+        frame_waited = true;
+#if USE_DVFS
+        dvfs_wait_us += time_us_32() - now;
+#endif
+}
+
+#if USE_IDLE_SLEEP
+/* Guest idle detection:
+ *
+ * When the 68K's PC stays within IDLE_PC_SPAN bytes for IDLE_LOOPS
+ * umac_loop()s in a row, with D0-D7/A0-A7 unchanged between them, the
+ * guest is taken to be spinning, e.g. waiting for Ticks to change or for
+ * input.  (A tight compute loop moves its registers, so doesn't count.)
+ * Rather than emulate the spin, core 1 skips ahead to the next VBL (i.e.
+ * vsync), input or deadline, sleeping in WFE until then.  Core 0 sends an
+ * event on each HID report.
+ *
+ * A loop polling a device (e.g. the VIA or SCC) may be waiting for more
+ * than those, so isn't idle either.  Musashi's memory accesses are
+ * handled inside umac, so this can only be seen as an address register
+ * pointing at the I/O space above IDLE_IO_BASE; the Mac ROM reaches the
+ * devices through their base addresses in low memory, i.e. that way.
+ */
+#define IDLE_PC_SPAN            32
+#define IDLE_LOOPS              8
+#define IDLE_IO_BASE            0x580000        /* SCSI, SCC, IWM and VIA */
+
+static uint32_t idle_pc;
+static uint32_t idle_regs[16];                  /* D0-D7, A0-A7 */
+static unsigned int idle_loops;
+
+static bool     guest_idle()
+{
+        uint32_t pc = m68k_get_reg(NULL, M68K_REG_PC);
+        bool idle = pc - idle_pc < IDLE_PC_SPAN || idle_pc - pc < IDLE_PC_SPAN;
+
+        for (int r = 0; r < 16; r++) {
+                uint32_t v = m68k_get_reg(NULL, M68K_REG_D0 + r);
+
+                if (v != idle_regs[r] || (r >= 8 && (v & 0xffffff) >= IDLE_IO_BASE))
+                        idle = false;
+                idle_regs[r] = v;
+        }
+        if (idle)
+                return ++idle_loops >= IDLE_LOOPS;
+        idle_pc = pc;
+        idle_loops = 0;
+        return false;
+}
+
+static bool     input_pending()
+{
+        return cursor_x != umac_cursor_x || cursor_y != umac_cursor_y ||
+                cursor_button != umac_cursor_button || !kbd_queue_empty();
+}
+
+static void     idle_sleep(unsigned int frame, uint32_t deadline)
+{
+        uint32_t now;
+#if SHOW_STATS || USE_DVFS
+        uint32_t start = time_us_32();
+#endif
+
+        while (video_frame_count == frame && !input_pending() &&
+               !deadline_due(now = time_us_32(), deadline)) {
+                best_effort_wfe_or_timeout(make_timeout_time_us(deadline - now));
+        }
+        idle_loops = 0;
+        frame_waited = true;
+#if SHOW_STATS
+        stats.idle_us += time_us_32() - start;
+#endif
+#if USE_DVFS
+        dvfs_wait_us += time_us_32() - start;
+#endif
+}
+#endif
+
+static void     poll_umac_init()
+{
+        uint32_t now = time_us_32();
+
+        last_vsync_frame = video_frame_count;
+        cpu_credit_us = now;
+#if USE_DVFS
+        dvfs_window_us = now;
+#endif
+        next_1hz_us = now + 1000000;
+        next_input_us = now;
+#if ENABLE_AUDIO
+        next_audio_us = now;
+#endif
+}
+
+static void     poll_umac()
+{
+        unsigned int frame = last_vsync_frame;
+        uint32_t deadline = next_deadline();
+        unsigned int budget = cpu_speed_budget(time_us_32());
+        unsigned int loops = 0;
+
+        if (budget == 0) {
+                cpu_speed_wait(time_us_32(), deadline);
+        } else {
+                bool idle = false;
+
+                do {
+                        umac_loop();
+                        loops++;
+#if USE_IDLE_SLEEP
+                        idle = guest_idle();
+#endif
+                } while (!idle && loops < budget && video_frame_count == frame &&
+                         !deadline_due(time_us_32(), deadline));
+                cpu_speed_charge(loops);
+#if USE_IDLE_SLEEP
+                if (idle)
+                        idle_sleep(frame, deadline);
+#endif
+        }
+        frame_loops += loops;
+#if SHOW_STATS
+        stats.loops += loops;
+#endif
+
+        /* Vsync comes only from the video output starting its vertical
+         * blanking.  Audio just refills free sound buffers with the
+         * samples from the last vsync; its clock differs slightly from
+         * the display's, so once in a while a buffer is repeated or
+         * dropped.
+         */
+        uint32_t now = time_us_32();
+
+        frame = video_frame_count;
+        if (frame != last_vsync_frame) {
+                last_vsync_frame = frame;
+                umac_vsync();
+        }
+#if ENABLE_AUDIO
+        if (deadline_due(now, next_audio_us)) {
+                next_audio_us = now + AUDIO_POLL_US;
+                audio_poll();
+        }
+#endif
+        if (deadline_due(now, next_1hz_us)) {
+                next_1hz_us += 1000000;
+                umac_1hz();
+        }
+        if (deadline_due(now, next_input_us)) {
+                next_input_us = now + INPUT_POLL_US;
+                umac_input();
+        }
+}
+
 #if USE_SD
 static int      disc_do_read(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
 {
@@ -320,6 +957,9 @@ static void     core1_main()
          * core 0's USB activity.
          */
 #if MIRROR_FRAMEBUFFER
+#if USE_FB_DMA
+        fb_dma_init();
+#endif
         video_init((uint32_t *)(umac_framebuffer_mirror));
 #else
         video_init((uint32_t *)(umac_ram + umac_get_fb_offset()));
@@ -330,6 +970,7 @@ static void     core1_main()
 #endif
         printf("Enjoyable Mac times now begin:\n\n");
 
+        poll_umac_init();
         while (true) {
                 poll_umac();
         }
@@ -434,14 +1075,8 @@ static void __no_inline_not_in_flash_func(setup_psram)(void) {
     // Disable direct csr.
     qmi_hw->direct_csr &= ~(QMI_DIRECT_CSR_ASSERT_CS1N_BITS | QMI_DIRECT_CSR_EN_BITS);
 
-    qmi_hw->m[1].timing =
-        QMI_M0_TIMING_PAGEBREAK_VALUE_1024 << QMI_M0_TIMING_PAGEBREAK_LSB | // Break between pages.
-            3 << QMI_M0_TIMING_SELECT_HOLD_LSB | // Delay releasing CS for 3 extra system cycles.
-            1 << QMI_M0_TIMING_COOLDOWN_LSB |
-            1 << QMI_M0_TIMING_RXDELAY_LSB |
-            16 << QMI_M0_TIMING_MAX_SELECT_LSB | // In units of 64 system clock cycles. PSRAM says 8us max. 8 / 0.00752 / 64 = 16.62
-            7 << QMI_M0_TIMING_MIN_DESELECT_LSB | // In units of system clock cycles. PSRAM says 50ns.50 / 7.52 = 6.64
-            2 << QMI_M0_TIMING_CLKDIV_LSB;
+    // CLKDIV etc. for the current clk_sys (refined later by qmi_calibrate())
+    set_psram_timing();
     qmi_hw->m[1].rfmt = (QMI_M0_RFMT_PREFIX_WIDTH_VALUE_Q << QMI_M0_RFMT_PREFIX_WIDTH_LSB |
             QMI_M0_RFMT_ADDR_WIDTH_VALUE_Q << QMI_M0_RFMT_ADDR_WIDTH_LSB |
             QMI_M0_RFMT_SUFFIX_WIDTH_VALUE_Q << QMI_M0_RFMT_SUFFIX_WIDTH_LSB |
@@ -489,17 +1124,154 @@ static void __no_inline_not_in_flash_func(setup_psram)(void) {
 #endif
 }
 
-int     main()
-{
 #if defined(OVERCLOCK) && OVERCLOCK+0
-        overclock(CLK_SYS_264MHZ, 252000);
+/* Overclock self-test:
+ *
+ * Not every chip is happy at 264MHz.  A checksum of some emulator-like
+ * work is computed at the stock clock, then again at each clk_sys tier
+ * from the fastest down, and the first tier to match is used.  The tier
+ * being tried is recorded in a watchdog scratch register (which survives
+ * everything but a power cycle or RUN reset), with the watchdog armed:
+ * if the test hangs, the next boot skips that tier.  A tier that passed
+ * is where the next boot starts.  If even the slowest tier hangs or fails
+ * the checksum, boots stay at the stock clock (until a power cycle clears
+ * the record).
+ */
+#define OC_SLOT                 0               /* watchdog_hw->scratch[] */
+#define OC_SLOT_MAGIC           0x0c7e5700
+#define OC_SLOT_TRYING          1
+#define OC_SLOT_PASSED          2
+#define OC_SLOT_STOCK           3               /* Every tier hung or failed */
+#define OC_TEST_WATCHDOG_MS     2000
+#define OC_TEST_PASSES          4
+#define OC_TEST_PSRAM_WORDS     (64*1024/4)
+#define DVI_BIT_CLK_KHZ         252000
+
+static const enum clk_sys_speed oc_tiers[] = {
+        CLK_SYS_264MHZ, CLK_SYS_176MHZ, CLK_SYS_132MHZ,
+};
+#define OC_TIERS        (sizeof(oc_tiers)/sizeof(oc_tiers[0]))
+
+/* A stand-in for the 68K core's inner loop: fetch 16-bit "opcodes" from
+ * the ROM image in flash and dispatch them through a table of ALU ops,
+ * some in SRAM and some in flash.
+ */
+typedef uint32_t (*oc_test_op_t)(uint32_t acc, uint32_t op);
+
+static uint32_t __not_in_flash_func(oc_op_add)(uint32_t acc, uint32_t op) { return acc + op; }
+static uint32_t __not_in_flash_func(oc_op_mul)(uint32_t acc, uint32_t op) { return acc * (op | 1); }
+static uint32_t __not_in_flash_func(oc_op_rot)(uint32_t acc, uint32_t op) { return (acc << (op & 31)) | (acc >> (-op & 31)); }
+static uint32_t __not_in_flash_func(oc_op_swap)(uint32_t acc, uint32_t op) { return __builtin_bswap32(acc) ^ op; }
+static uint32_t oc_op_sub(uint32_t acc, uint32_t op) { return acc - (op << 16); }
+static uint32_t oc_op_xor(uint32_t acc, uint32_t op) { return acc ^ (op * 0x9e3779b9u); }
+static uint32_t oc_op_div(uint32_t acc, uint32_t op) { return acc / (op | 1) + acc; }
+static uint32_t oc_op_clz(uint32_t acc, uint32_t op) { return acc + __builtin_clz(acc | 1) + op; }
+
+static oc_test_op_t oc_test_ops[8] = {
+        oc_op_add, oc_op_mul, oc_op_rot, oc_op_swap,
+        oc_op_sub, oc_op_xor, oc_op_div, oc_op_clz,
+};
+
+static uint32_t oc_test_checksum()
+{
+        const uint16_t *ops = (const uint16_t *)umac_rom;
+        uint32_t acc = 0x12345678;
+
+        for (int pass = 0; pass < OC_TEST_PASSES; pass++) {
+                for (unsigned int i = 0; i < sizeof(umac_rom) / 2; i++) {
+                        uint16_t op = ops[i];
+                        acc = oc_test_ops[op >> 13](acc, op);
+                }
+        }
+
+#if USE_PSRAM
+        /* A pattern derived from the running checksum, through PSRAM */
+        if (_psram_size) {
+                volatile uint32_t *psram_nocache = (volatile uint32_t *)0x15000000;
+
+                for (int i = 0; i < OC_TEST_PSRAM_WORDS; i++)
+                        psram_nocache[i] = acc ^ (i * 0x9e3779b9u);
+                for (int i = 0; i < OC_TEST_PSRAM_WORDS; i++)
+                        acc = oc_op_rot(acc, 7) ^ psram_nocache[i];
+        }
+#endif
+        return acc;
+}
+
+static bool oc_stock;                   /* Left at the stock clock */
+
+static void     overclock_tested()
+{
+        uint32_t slot = watchdog_hw->scratch[OC_SLOT];
+        unsigned int first = 0;
+
+        if ((slot & ~0xffu) == OC_SLOT_MAGIC && (slot & 0xf) < OC_TIERS) {
+                unsigned int state = (slot >> 4) & 0xf;
+
+                first = slot & 0xf;
+                if (state == OC_SLOT_STOCK ||
+                    (state == OC_SLOT_TRYING && first == OC_TIERS - 1)) {
+                        /* The slowest tier hung or failed: don't overclock */
+                        watchdog_hw->scratch[OC_SLOT] = OC_SLOT_MAGIC | OC_SLOT_STOCK << 4 | first;
+                        oc_stock = true;
+                        return;
+                }
+                if (state == OC_SLOT_TRYING)
+                        first++;        /* Hung or crashed last time */
+        }
+
+        uint32_t expected = oc_test_checksum();
+
+        for (unsigned int t = first; t < OC_TIERS; t++) {
+                watchdog_hw->scratch[OC_SLOT] = OC_SLOT_MAGIC | OC_SLOT_TRYING << 4 | t;
+                watchdog_enable(OC_TEST_WATCHDOG_MS, true);
+                overclock(oc_tiers[t], DVI_BIT_CLK_KHZ);
+#if USE_DVFS
+                dvfs_speed = dvfs_top_speed = oc_tiers[t];
+#endif
+                bool ok = oc_test_checksum() == expected;
+                watchdog_disable();
+
+                if (ok) {
+                        watchdog_hw->scratch[OC_SLOT] = OC_SLOT_MAGIC | OC_SLOT_PASSED << 4 | t;
+                        printf("Overclock self-test passed at %u MHz\n",
+                               (unsigned int)(clock_get_hz(clk_sys) / MHZ));
+                        return;
+                }
+                printf("Overclock self-test failed at %u MHz\n",
+                       (unsigned int)(clock_get_hz(clk_sys) / MHZ));
+        }
+        /* Nothing passed: reboot into the stock clock, as for a hang, since
+         * the PLLs and QMI timings have been changed behind the SDK's back.
+         */
+        printf("*** Overclock self-test failed at every speed, rebooting at the stock clock\n");
+        watchdog_hw->scratch[OC_SLOT] = OC_SLOT_MAGIC | OC_SLOT_STOCK << 4 | (OC_TIERS - 1);
+        watchdog_reboot(0, 0, 0);
+        while (1)
+                tight_loop_contents();
+}
 #endif
+
+int     main()
+{
         // set_sys_clock_khz(250*1000, true);
 
         setup_psram();
+#if defined(OVERCLOCK) && OVERCLOCK+0
+        overclock_tested();
+#endif
 
 	stdio_init_all();
         io_init();
+#if defined(OVERCLOCK) && OVERCLOCK+0
+        if (oc_stock)
+                printf("*** Overclocking failed at every speed, running at the stock clock\n");
+#endif
+
+#if USE_QMI_CALIBRATION
+        /* Core 1 isn't running yet, so flash timing can be changed: */
+        qmi_calibrate(umac_rom, _psram_size != 0);
+#endif
 
 #define SHOW_CLK(i) printf("clk_get_hz(%s) -> %u\n", #i, clock_get_hz(i));
         SHOW_CLK(clk_gpout0);
@@ -517,12 +1289,17 @@ int     main()
         audio_setup();
 #endif
 
+        /* Core 1 claims the video DMA channels as it starts, and PIO USB
+         * uses its TX channel without claiming it, so claim that first:
+         */
+        int usb_tx_ch = dma_claim_unused_channel(true);
+
         multicore_launch_core1(core1_main);
 
 	printf("Starting, init usb\n");
 
         pio_usb_configuration_t pio_cfg = PIO_USB_DEFAULT_CONFIG;
-        pio_cfg.tx_ch = 2;
+        pio_cfg.tx_ch = usb_tx_ch;
         pio_cfg.pin_dp = PICO_DEFAULT_PIO_USB_DP_PIN;
         _Static_assert(PIN_USB_HOST_DP + 1 == PIN_USB_HOST_DM || PIN_USB_HOST_DP - 1 == PIN_USB_HOST_DM, "Permitted USB D+/D- configuration");
         pio_cfg.pinout = PIN_USB_HOST_DP + 1 == PIN_USB_HOST_DM ? PIO_USB_PINOUT_DPDM : PIO_USB_PINOUT_DMDP;
@@ -748,13 +1525,12 @@ setup_i2s_dac();
     audio_i2s_set_enabled(true);
 }
 
-static bool audio_poll() {
+static void audio_poll() {
     audio_buffer_t *buffer = take_audio_buffer(producer_pool, false);
-    if (!buffer) return false;
+    if (!buffer) return;
     memcpy(buffer->buffer->bytes, audio, sizeof(audio));
     buffer->sample_count = SAMPLES_PER_BUFFER;
     give_audio_buffer(producer_pool, buffer);
-    return true;
 }
 
 static bool mute_state = false;
@@ -31,6 +31,11 @@
 #include "hardware/structs/bus_ctrl.h"
 #include "hardware/structs/hstx_ctrl.h"
 #include "hardware/structs/hstx_fifo.h"
+#include "pico/time.h"
+#if USE_PSRAM && USE_PSRAM_SCANOUT
+#include "hardware/xip_cache.h"
+#endif
+#include "video.h"
 
 // ----------------------------------------------------------------------------
 // DVI constants
@@ -40,10 +45,14 @@
 #define TMDS_CTRL_10 0x154u
 #define TMDS_CTRL_11 0x2abu
 
-#define SYNC_V0_H0 (TMDS_CTRL_00 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20))
-#define SYNC_V0_H1 (TMDS_CTRL_01 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20))
-#define SYNC_V1_H0 (TMDS_CTRL_10 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20))
-#define SYNC_V1_H1 (TMDS_CTRL_11 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20))
+// Every HSTX output is inverted (see HSTX_INV below), so the control
+// symbols of all three lanes are sent pre-inverted to arrive intact.
+#define SYNC_INV 0x3fffffffu
+
+#define SYNC_V0_H0 ((TMDS_CTRL_00 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20)) ^ SYNC_INV)
+#define SYNC_V0_H1 ((TMDS_CTRL_01 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20)) ^ SYNC_INV)
+#define SYNC_V1_H0 ((TMDS_CTRL_10 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20)) ^ SYNC_INV)
+#define SYNC_V1_H1 ((TMDS_CTRL_11 | (TMDS_CTRL_00 << 10) | (TMDS_CTRL_00 << 20)) ^ SYNC_INV)
 
 #define MODE_H_SYNC_POLARITY 0
 #define MODE_H_FRONT_PORCH   16
@@ -86,26 +95,94 @@
 
 // ----------------------------------------------------------------------------
 // HSTX command lists
+//
+// Runs of identical lines are sent by a single DMA transfer using a read
+// ring, so these are padded with NOPs to a power-of-two size and aligned
+// to it.
 
-static uint32_t vblank_line_vsync_off[] = {
+static uint32_t vblank_line_vsync_off[8] __attribute__((aligned(32))) = {
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_FRONT_PORCH),
     BSWAP_MAYBE(SYNC_V1_H1),
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_SYNC_WIDTH),
     BSWAP_MAYBE(SYNC_V1_H0),
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | (MODE_H_BACK_PORCH + MODE_H_ACTIVE_PIXELS)),
     BSWAP_MAYBE(SYNC_V1_H1),
+    BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP),
 };
 
-static uint32_t vblank_line_vsync_on[] = {
+static uint32_t vblank_line_vsync_on[8] __attribute__((aligned(32))) = {
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_FRONT_PORCH),
     BSWAP_MAYBE(SYNC_V0_H1),
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_SYNC_WIDTH),
     BSWAP_MAYBE(SYNC_V0_H0),
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | (MODE_H_BACK_PORCH + MODE_H_ACTIVE_PIXELS)),
     BSWAP_MAYBE(SYNC_V0_H1),
+    BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP),
+};
+
+// A framebuffer smaller than the mode (i.e. 512x342) is centred, with the
+// borders generated by TMDS_REPEAT runs rather than stored pixels.  Since
+// the outputs are inverted (see below), all-ones is black.
+#define H_BORDER ((MODE_H_ACTIVE_PIXELS - DISP_WIDTH) / 2)
+#define V_BORDER ((MODE_V_ACTIVE_LINES - DISP_HEIGHT) / 2)
+#define BORDER_PIXELS 0xffffffffu
+
+#if (DISP_WIDTH % 32) || DISP_WIDTH > MODE_H_ACTIVE_PIXELS || DISP_HEIGHT > MODE_V_ACTIVE_LINES
+#error "Unsupported DISP_WIDTH/DISP_HEIGHT for HSTX video"
+#endif
+#if H_BORDER && !V_BORDER
+#error "HSTX video needs a top border line when there's a side border"
+#endif
+
+// The glue between framebuffer rows, i.e. everything on an active line
+// except the pixels themselves:  the previous row's right border,
+// horizontal blanking, the left border and the TMDS command for the row
+// (whose data is then DMAed from the framebuffer).  Starting with the
+// previous line's right border means one transfer per row.
+static uint32_t vactive_line[16] __attribute__((aligned(64))) = {
+#if H_BORDER
+    BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP),
+    BSWAP_MAYBE(HSTX_CMD_TMDS_REPEAT | H_BORDER),
+    BSWAP_MAYBE(BORDER_PIXELS),
+#else
+    BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP),
+    BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP),
+#endif
+    BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_FRONT_PORCH),
+    BSWAP_MAYBE(SYNC_V1_H1),
+    BSWAP_MAYBE(HSTX_CMD_NOP),
+    BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_SYNC_WIDTH),
+    BSWAP_MAYBE(SYNC_V1_H0),
+    BSWAP_MAYBE(HSTX_CMD_NOP),
+    BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_BACK_PORCH),
+    BSWAP_MAYBE(SYNC_V1_H1),
+#if H_BORDER
+    BSWAP_MAYBE(HSTX_CMD_TMDS_REPEAT | H_BORDER),
+    BSWAP_MAYBE(BORDER_PIXELS),
+#endif
+    BSWAP_MAYBE(HSTX_CMD_TMDS | DISP_WIDTH),
+};
+
+// Lines above and below the framebuffer
+static uint32_t vactive_line_border[16] __attribute__((aligned(64))) = {
+    BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_FRONT_PORCH),
+    BSWAP_MAYBE(SYNC_V1_H1),
+    BSWAP_MAYBE(HSTX_CMD_NOP),
+    BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_SYNC_WIDTH),
+    BSWAP_MAYBE(SYNC_V1_H0),
+    BSWAP_MAYBE(HSTX_CMD_NOP),
+    BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_BACK_PORCH),
+    BSWAP_MAYBE(SYNC_V1_H1),
+    BSWAP_MAYBE(HSTX_CMD_TMDS_REPEAT | MODE_H_ACTIVE_PIXELS),
+    BSWAP_MAYBE(BORDER_PIXELS),
+    BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP),
+    BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP), BSWAP_MAYBE(HSTX_CMD_NOP),
 };
 
-static uint32_t vactive_line[] = {
+#if H_BORDER
+// The last border line before the framebuffer is short by H_BORDER,
+// because the first row's glue provides that right border.
+static uint32_t vactive_line_border_short[] = {
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_FRONT_PORCH),
     BSWAP_MAYBE(SYNC_V1_H1),
     BSWAP_MAYBE(HSTX_CMD_NOP),
@@ -114,108 +191,314 @@ static uint32_t vactive_line[] = {
     BSWAP_MAYBE(HSTX_CMD_NOP),
     BSWAP_MAYBE(HSTX_CMD_RAW_REPEAT | MODE_H_BACK_PORCH),
     BSWAP_MAYBE(SYNC_V1_H1),
-    BSWAP_MAYBE(HSTX_CMD_TMDS | MODE_H_ACTIVE_PIXELS),
+    BSWAP_MAYBE(HSTX_CMD_TMDS_REPEAT | (MODE_H_ACTIVE_PIXELS - H_BORDER)),
+    BSWAP_MAYBE(BORDER_PIXELS),
 };
 
+// ...and the last row's right border follows it directly.
+static uint32_t vactive_line_end[] = {
+    BSWAP_MAYBE(HSTX_CMD_TMDS_REPEAT | H_BORDER),
+    BSWAP_MAYBE(BORDER_PIXELS),
+};
+#endif
+
+// ----------------------------------------------------------------------------
+// DMA frame program
+//
+// Rather than a table with an entry per line, a frame is described by a
+// short program of DMA descriptors which loops on its own, and five
+// channels:
+//
+//  cmd:  copies the next descriptor of video_program[] into px's
+//        registers, the last write triggering it.
+//  px:   executes a descriptor, then chains back to cmd.  A descriptor
+//        is either a run of identical lines (replayed from a read ring),
+//        or a single-word poke of another channel's register.
+//  glue: sends vactive_line, then chains to fb.
+//  fb:   sends one framebuffer row, then chains to tick.  Its read
+//        address just carries on from one row to the next.
+//  tick: counts rows by copying the next entry of video_ticks[] to
+//        MULTI_CHAN_TRIGGER: glue's bit for another row, or cmd's for the
+//        last entry, so the program continues.
+//
+// A run of n rows is started by pointing tick at the last n entries of
+// video_ticks[] then triggering glue.  After the last row, a descriptor
+// raises an IRQ to count the frame.  The last descriptor points cmd back
+// at the start of the program.
+//
+// With VIDEO_LINE_BUFFERS (a framebuffer in PSRAM), fb instead reads a
+// small ring of line buffers in SRAM, which a sixth channel keeps filled
+// a few rows ahead:
+//
+//  fill: copies one row from the uncached PSRAM alias into the ring.  It's
+//        triggered by tick along with glue, so fetches row r + AHEAD while
+//        row r + 1 is sent.
+//
+// The program prefills the first rows, then points fill at the next one.
+// So scanout neither misses in nor pollutes the XIP cache, and a slow
+// PSRAM read has a few rows' grace.  The cache is write-back, though, so
+// the frame IRQ cleans the framebuffer's lines before fill next reads
+// them.
+
 typedef struct {
-    uint32_t *dma_commands;
-    size_t dma_commands_len; // in words
-    uint8_t dma_pixel_channel;
-    uint8_t dma_command_channel;
-} picodvi_framebuffer_obj_t;
+    const volatile void *raddr;
+    volatile void *waddr;
+    uint32_t count;
+    uint32_t ctrl;
+} dma_descr_t;
+
+#define VIDEO_LINE_BUFFERS  (USE_PSRAM && USE_PSRAM_SCANOUT)
+
+#define VIDEO_TICKS         128
+#define VIDEO_RUNS          ((DISP_HEIGHT + VIDEO_TICKS - 1) / VIDEO_TICKS)
+#if VIDEO_LINE_BUFFERS
+// Rows take a poke for fb, the prefill, 2 pokes for fill, 2 per run and
+// a fill kick between runs:
+#define VIDEO_ROWS_LEN      (4 + 3 * VIDEO_RUNS)
+#else
+// Rows take a poke for fb and 2 per run:
+#define VIDEO_ROWS_LEN      (1 + 2 * VIDEO_RUNS)
+#endif
+// 5 line runs (vsync, back porch, border, short border, bottom border),
+// the rows, the row tail, IRQ, front porch and restart:
+#define VIDEO_PROGRAM_LEN   (5 + VIDEO_ROWS_LEN + 4)
+
+static dma_descr_t video_program[VIDEO_PROGRAM_LEN];
+static uint32_t video_poke_data[VIDEO_PROGRAM_LEN];
+static size_t video_program_len;
+// Written 16 bits at a time, which the bus replicates into the top half
+// of MULTI_CHAN_TRIGGER (where there are no channels):
+static uint16_t video_ticks[VIDEO_TICKS];
+
+#if VIDEO_LINE_BUFFERS
+#define VIDEO_ROW_WORDS     (DISP_WIDTH / 32)
+#define VIDEO_RING_BITS     8
+#define VIDEO_RING_WORDS    ((1u << VIDEO_RING_BITS) / sizeof(uint32_t))
+// Rows fill fetches ahead of the one being sent (4 at 512 wide, 3 at 640):
+#define VIDEO_AHEAD         (VIDEO_RING_WORDS / VIDEO_ROW_WORDS)
+
+// Rows wrap around the end of the ring, like the reads and writes of it:
+static uint32_t video_line_ring[VIDEO_RING_WORDS] __attribute__((aligned(1u << VIDEO_RING_BITS)));
+static uint32_t *video_framebuffer;
+#endif
+
+static uint8_t dma_cmd_channel;
+static uint8_t dma_px_channel;
+static uint8_t dma_glue_channel;
+static uint8_t dma_fb_channel;
+static uint8_t dma_tick_channel;
+#if VIDEO_LINE_BUFFERS
+static uint8_t dma_fill_channel;
+#endif
+
+static uint32_t dma_lines_ctrl;
+static uint32_t dma_poke_ctrl;
+#if VIDEO_LINE_BUFFERS
+static uint32_t dma_prefill_ctrl;
+#endif
+static uint32_t dma_irq_sink;
+
+volatile unsigned int video_frame_count = 0;
+#if SHOW_STATS
+volatile unsigned int video_irq_us = 0;
+#endif
 
-picodvi_framebuffer_obj_t *active_picodvi = NULL;
-picodvi_framebuffer_obj_t picodvi;
+#if VIDEO_LINE_BUFFERS
+// Write back the guest's screen writes still held in the XIP cache, so
+// the uncached reads see them
+static void __not_in_flash_func(video_clean_framebuffer)(void) {
+    uintptr_t addr = (uintptr_t)video_framebuffer;
+    if (addr >= XIP_BASE && addr < XIP_NOCACHE_NOALLOC_BASE) {
+        xip_cache_clean_range(addr - XIP_BASE, DISP_HEIGHT * VIDEO_ROW_WORDS * sizeof(uint32_t));
+    }
+}
+#endif
 
 static void __not_in_flash_func(dma_irq_handler)(void) {
-    if (active_picodvi == NULL) {
+#if SHOW_STATS
+    uint32_t start = time_us_32();
+#endif
+    dma_hw->ints2 = 1u << dma_px_channel;
+    video_frame_count++;
+#if VIDEO_LINE_BUFFERS
+    // fill restarts with the next frame's prefill, after the blanking lines
+    video_clean_framebuffer();
+#endif
+#if SHOW_STATS
+    video_irq_us += time_us_32() - start;
+#endif
+}
+
+static void video_program_add(const volatile void *raddr, volatile void *waddr, uint32_t count, uint32_t ctrl) {
+    dma_descr_t *d = &video_program[video_program_len++];
+    d->raddr = raddr;
+    d->waddr = waddr;
+    d->count = count;
+    d->ctrl = ctrl;
+}
+
+// Send n copies of a line (a power-of-two number of words, aligned) to HSTX
+static void video_program_lines(const uint32_t *line, size_t line_words, size_t n) {
+    if (n == 0) {
         return;
     }
-    uint ch_num = active_picodvi->dma_pixel_channel;
-    dma_channel_hw_t *ch = &dma_hw->ch[ch_num];
-    dma_hw->intr = 1u << ch_num;
-
-    // Set the read_addr back to the start and trigger the first transfer (which
-    // will trigger the pixel channel).
-    ch = &dma_hw->ch[active_picodvi->dma_command_channel];
-    ch->al3_read_addr_trig = (uintptr_t)active_picodvi->dma_commands;
+    uint ring_bits = __builtin_ctz(line_words * sizeof(uint32_t));
+    video_program_add(line, &hstx_fifo_hw->fifo, n * line_words,
+        dma_lines_ctrl | (ring_bits << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB));
 }
 
-#define REAL_DISP_WIDTH 640
-#define REAL_DISP_HEIGHT 480
+// Send a list of commands once
+static void video_program_cmds(const uint32_t *cmds, size_t words) {
+    video_program_add(cmds, &hstx_fifo_hw->fifo, words, dma_lines_ctrl);
+}
 
-void    video_init(uint32_t *framebuffer) {
-    picodvi_framebuffer_obj_t *self = &picodvi;
-
-    // We compute all DMA transfers needed for a single frame. This ensure we don't have any super
-    // quick interrupts that we need to respond to. Each transfer takes two words, trans_count and
-    // read_addr. Active pixel lines need two transfers due to different read addresses. When pixel
-    // doubling, then we must also set transfer size.
-    size_t dma_command_size = 2;
-    self->dma_commands_len = (MODE_V_FRONT_PORCH + MODE_V_SYNC_WIDTH + MODE_V_BACK_PORCH + 2 * MODE_V_ACTIVE_LINES + 1) * dma_command_size;
-    self->dma_commands = (uint32_t *)malloc(self->dma_commands_len * sizeof(uint32_t));
-    if (self->dma_commands == NULL) {
-        return;
+// Write value to a register.  With chain false, px doesn't return to cmd
+// (the poke itself hands over control).
+static void video_program_poke(volatile void *reg, uint32_t value, bool chain) {
+    uint32_t ctrl = dma_poke_ctrl |
+        ((chain ? dma_cmd_channel : dma_px_channel) << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB);
+    video_poke_data[video_program_len] = value;
+    video_program_add(&video_poke_data[video_program_len], reg, 1, ctrl);
+}
+
+// Raise DMA_IRQ_2 (by a dummy poke that isn't IRQ_QUIET)
+static void video_program_irq(void) {
+    uint32_t ctrl = (dma_poke_ctrl & ~DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS) |
+        (dma_cmd_channel << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB);
+    video_program_add(&video_poke_data[video_program_len], &dma_irq_sink, 1, ctrl);
+}
+
+#if !VIDEO_LINE_BUFFERS
+// Send the rows, starting at framebuffer
+static void video_program_rows(const uint32_t *framebuffer) {
+    video_program_poke(&dma_hw->ch[dma_fb_channel].read_addr, (uintptr_t)framebuffer, true);
+    for (size_t row = 0; row < DISP_HEIGHT; row += VIDEO_TICKS) {
+        size_t n = DISP_HEIGHT - row;
+        if (n > VIDEO_TICKS) {
+            n = VIDEO_TICKS;
+        }
+        video_program_poke(&dma_hw->ch[dma_tick_channel].read_addr,
+            (uintptr_t)&video_ticks[VIDEO_TICKS - n], true);
+        video_program_poke(&dma_hw->multi_channel_trigger, 1u << dma_glue_channel, false);
+    }
+}
+
+#else
+// Read PSRAM through the uncached alias
+static const uint32_t *video_uncached(const uint32_t *p) {
+    uintptr_t addr = (uintptr_t)p;
+    if (addr >= XIP_BASE && addr < XIP_NOCACHE_NOALLOC_BASE) {
+        addr += XIP_NOCACHE_NOALLOC_BASE - XIP_BASE;
+    }
+    return (const uint32_t *)addr;
+}
+
+static uint32_t *video_ring_row(size_t row) {
+    return &video_line_ring[(row * VIDEO_ROW_WORDS) % VIDEO_RING_WORDS];
+}
+
+// Send the rows through the ring, kicking fill between runs (the last
+// tick entry only continues the program)
+static void video_program_rows(const uint32_t *framebuffer) {
+    const uint32_t *fb = video_uncached(framebuffer);
+
+    video_program_poke(&dma_hw->ch[dma_fb_channel].read_addr, (uintptr_t)video_line_ring, true);
+
+    // Prefill the first VIDEO_AHEAD rows, then point fill at the next
+    video_program_add(fb, video_ring_row(0), VIDEO_AHEAD * VIDEO_ROW_WORDS, dma_prefill_ctrl);
+    video_program_poke(&dma_hw->ch[dma_fill_channel].write_addr, (uintptr_t)video_ring_row(VIDEO_AHEAD), true);
+    video_program_poke(&dma_hw->ch[dma_fill_channel].read_addr,
+        (uintptr_t)(fb + VIDEO_AHEAD * VIDEO_ROW_WORDS), true);
+
+    for (size_t row = 0; row < DISP_HEIGHT; ) {
+        size_t n = DISP_HEIGHT - row;
+        if (n > VIDEO_TICKS) {
+            n = VIDEO_TICKS;
+        }
+        video_program_poke(&dma_hw->ch[dma_tick_channel].read_addr,
+            (uintptr_t)&video_ticks[VIDEO_TICKS - n], true);
+        video_program_poke(&dma_hw->multi_channel_trigger, 1u << dma_glue_channel, false);
+        row += n;
+        if (row < DISP_HEIGHT) {
+            video_program_poke(&dma_hw->multi_channel_trigger, 1u << dma_fill_channel, true);
+        }
     }
+}
+#endif
+
+static void video_program_build(uint32_t *framebuffer) {
+    video_program_len = 0;
+
+    video_program_lines(vblank_line_vsync_on, count_of(vblank_line_vsync_on), MODE_V_SYNC_WIDTH);
+    video_program_lines(vblank_line_vsync_off, count_of(vblank_line_vsync_off), MODE_V_BACK_PORCH);
+#if H_BORDER
+    video_program_lines(vactive_line_border, count_of(vactive_line_border), V_BORDER - 1);
+    video_program_cmds(vactive_line_border_short, count_of(vactive_line_border_short));
+#else
+    video_program_lines(vactive_line_border, count_of(vactive_line_border), V_BORDER);
+#endif
+
+    video_program_rows(framebuffer);
+
+#if H_BORDER
+    video_program_cmds(vactive_line_end, count_of(vactive_line_end));
+#endif
+    video_program_irq();
+    video_program_lines(vactive_line_border, count_of(vactive_line_border),
+        MODE_V_ACTIVE_LINES - V_BORDER - DISP_HEIGHT);
+    video_program_lines(vblank_line_vsync_off, count_of(vblank_line_vsync_off), MODE_V_FRONT_PORCH);
+
+    video_program_poke(&dma_hw->ch[dma_cmd_channel].read_addr, (uintptr_t)video_program, true);
+}
 
-    self->dma_pixel_channel = dma_claim_unused_channel(true);
-    self->dma_command_channel = dma_claim_unused_channel(true);
+void    video_init(uint32_t *framebuffer) {
+    dma_cmd_channel = dma_claim_unused_channel(true);
+    dma_px_channel = dma_claim_unused_channel(true);
+    dma_glue_channel = dma_claim_unused_channel(true);
+    dma_fb_channel = dma_claim_unused_channel(true);
+    dma_tick_channel = dma_claim_unused_channel(true);
+#if VIDEO_LINE_BUFFERS
+    dma_fill_channel = dma_claim_unused_channel(true);
+#endif
 
     size_t pixels_per_word = 32;
-    size_t words_per_line = REAL_DISP_WIDTH / pixels_per_word;
+    size_t words_per_line = DISP_WIDTH / pixels_per_word;
     uint8_t rot = 24; // 24 + color_depth;
     size_t shift_amount = 31; // color_depth % 32;
 
-    size_t command_word = 0;
-    size_t frontporch_start = MODE_V_TOTAL_LINES - MODE_V_FRONT_PORCH;
-    size_t frontporch_end = frontporch_start + MODE_V_FRONT_PORCH;
-    size_t vsync_start = 0;
-    size_t vsync_end = vsync_start + MODE_V_SYNC_WIDTH;
-    size_t backporch_start = vsync_end;
-    size_t backporch_end = backporch_start + MODE_V_BACK_PORCH;
-    size_t active_start = backporch_end;
-
-    uint32_t dma_ctrl = (self->dma_command_channel << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB) |
-        (DREQ_HSTX << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB) |
-        DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS |
-        DMA_CH0_CTRL_TRIG_INCR_READ_BITS |
+    uint32_t dma_ctrl = DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS |
+        (DMA_SIZE_32 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB) |
         DMA_CH0_CTRL_TRIG_EN_BITS;
-    uint32_t dma_pixel_ctrl = dma_ctrl | ((pixels_per_word == 32 ? DMA_SIZE_32 : DMA_SIZE_16) << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB);
+    dma_lines_ctrl = dma_ctrl |
+        (dma_cmd_channel << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB) |
+        (DREQ_HSTX << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB) |
+        DMA_CH0_CTRL_TRIG_INCR_READ_BITS;
 #if DO_BSWAP
-    dma_pixel_ctrl |= DMA_CH0_CTRL_TRIG_BSWAP_BITS;
+    dma_lines_ctrl |= DMA_CH0_CTRL_TRIG_BSWAP_BITS;
 #endif
-    dma_ctrl |= (DMA_SIZE_32 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB);
-
-    uint32_t dma_write_addr = (uint32_t)&hstx_fifo_hw->fifo;
-    // Write ctrl and write_addr once when not pixel doubling because they don't
-    // change. (write_addr doesn't change when pixel doubling either but we need
-    // to rewrite it because it is after the ctrl register.)
-    dma_channel_hw_addr(self->dma_pixel_channel)->al1_ctrl = dma_pixel_ctrl;
-    dma_channel_hw_addr(self->dma_pixel_channel)->al1_write_addr = dma_write_addr;
-
-    for (size_t v_scanline = 0; v_scanline < MODE_V_TOTAL_LINES; v_scanline++) {
-        if (vsync_start <= v_scanline && v_scanline < vsync_end) {
-            self->dma_commands[command_word++] = count_of(vblank_line_vsync_on);
-            self->dma_commands[command_word++] = (uintptr_t)vblank_line_vsync_on;
-        } else if (backporch_start <= v_scanline && v_scanline < backporch_end) {
-            self->dma_commands[command_word++] = count_of(vblank_line_vsync_off);
-            self->dma_commands[command_word++] = (uintptr_t)vblank_line_vsync_off;
-        } else if (frontporch_start <= v_scanline && v_scanline < frontporch_end) {
-            self->dma_commands[command_word++] = count_of(vblank_line_vsync_off);
-            self->dma_commands[command_word++] = (uintptr_t)vblank_line_vsync_off;
-        } else {
-            self->dma_commands[command_word++] = count_of(vactive_line);
-            self->dma_commands[command_word++] = (uintptr_t)vactive_line;
-            size_t row = v_scanline - active_start;
-            size_t transfer_count = words_per_line;
-            self->dma_commands[command_word++] = transfer_count;
-            uintptr_t row_start = row * (REAL_DISP_WIDTH / 8) + (uintptr_t)framebuffer;
-            self->dma_commands[command_word++] = row_start;
-        }
+    // The chain is chosen per-poke:
+    dma_poke_ctrl = dma_ctrl | (DREQ_FORCE << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB);
+#if VIDEO_LINE_BUFFERS
+    // Rows into the ring, as fast as PSRAM allows
+    dma_prefill_ctrl = dma_poke_ctrl |
+        (dma_cmd_channel << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB) |
+        DMA_CH0_CTRL_TRIG_INCR_READ_BITS | DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS |
+        DMA_CH0_CTRL_TRIG_RING_SEL_BITS | (VIDEO_RING_BITS << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB);
+
+    for (size_t i = 0; i < VIDEO_TICKS - 1; i++) {
+        video_ticks[i] = (1u << dma_glue_channel) | (1u << dma_fill_channel);
     }
-    // Last command is NULL which will trigger an IRQ.
-    self->dma_commands[command_word++] = 0;
-    self->dma_commands[command_word++] = 0;
+#else
+    for (size_t i = 0; i < VIDEO_TICKS - 1; i++) {
+        video_ticks[i] = 1u << dma_glue_channel;
+    }
+#endif
+    video_ticks[VIDEO_TICKS - 1] = 1u << dma_cmd_channel;
+
+#if VIDEO_LINE_BUFFERS
+    video_framebuffer = framebuffer;
+#endif
+    video_program_build(framebuffer);
 
     // B&W
     size_t color_depth = 1;
@@ -246,18 +529,25 @@ void    video_init(uint32_t *framebuffer) {
             (2u << HSTX_CTRL_CSR_SHIFT_LSB) |
             HSTX_CTRL_CSR_EN_BITS;
 
-    // XXX this may be wrong, because pico-mac is using an overclock (but is it OC'ing HSTX? not sure)
-
-    // Note we are leaving the HSTX clock at the SDK default of 125 MHz; since
-    // we shift out two bits per HSTX clock cycle, this gives us an output of
-    // 250 Mbps, which is very close to the bit clock for 480p 60Hz (252 MHz).
-    // If we want the exact rate then we'll have to reconfigure PLLs.
+    // We shift out two bits per HSTX clock cycle.  Overclocked builds have
+    // overclock()'s clock planner run clk_hstx at exactly 126 MHz, giving
+    // the 252 Mbps bit clock for 480p 60Hz.  Otherwise the HSTX clock is
+    // left at the SDK default of 125 MHz, for 250 Mbps, which is very close.
 
 #define HSTX_FIRST_PIN 12
 
+    // The Mac framebuffer is 1=black.  Rather than inverting pixels on the
+    // CPU, every HSTX output is inverted, which is the same as swapping P/N
+    // of each pair.  An inverted TMDS data symbol decodes as x ^ 0xfe, so
+    // the sink sees the framebuffer's 1s as (near) black and 0s as (near)
+    // white.  Inverting a control symbol would only flip C0 of its lane,
+    // so those are sent pre-inverted instead (see SYNC_INV).  This lets the
+    // framebuffer be scanned out, or mirrored by DMA, as-is.
+#define HSTX_INV HSTX_CTRL_BIT0_INV_BITS
+
     // Setup the data to pin mapping.
-    hstx_ctrl_hw->bit[(HSTX_CKP    ) - HSTX_FIRST_PIN] = HSTX_CTRL_BIT0_CLK_BITS;
-    hstx_ctrl_hw->bit[(HSTX_CKP ^ 1) - HSTX_FIRST_PIN] = HSTX_CTRL_BIT0_CLK_BITS | HSTX_CTRL_BIT0_INV_BITS;
+    hstx_ctrl_hw->bit[(HSTX_CKP    ) - HSTX_FIRST_PIN] = HSTX_CTRL_BIT0_CLK_BITS | HSTX_INV;
+    hstx_ctrl_hw->bit[(HSTX_CKP ^ 1) - HSTX_FIRST_PIN] = HSTX_CTRL_BIT0_CLK_BITS;
 
     const int pinout[] = { HSTX_D0P, HSTX_D1P, HSTX_D2P };
 
@@ -268,8 +558,8 @@ void    video_init(uint32_t *framebuffer) {
             (lane * 10    ) << HSTX_CTRL_BIT0_SEL_P_LSB |
             (lane * 10 + 1) << HSTX_CTRL_BIT0_SEL_N_LSB;
         // The two halves of each pair get identical data, but one pin is inverted.
-        hstx_ctrl_hw->bit[(bit    ) - HSTX_FIRST_PIN] = lane_data_sel_bits;
-        hstx_ctrl_hw->bit[(bit ^ 1) - HSTX_FIRST_PIN] = lane_data_sel_bits | HSTX_CTRL_BIT0_INV_BITS;
+        hstx_ctrl_hw->bit[(bit    ) - HSTX_FIRST_PIN] = lane_data_sel_bits | HSTX_INV;
+        hstx_ctrl_hw->bit[(bit ^ 1) - HSTX_FIRST_PIN] = lane_data_sel_bits;
     }
 
     for (int i = 12; i <= 19; ++i) {
@@ -277,33 +567,73 @@ void    video_init(uint32_t *framebuffer) {
     }
 
     dma_channel_config c;
-    c = dma_channel_get_default_config(self->dma_command_channel);
+
+    // glue: vactive_line from its ring, then fb
+    c = dma_channel_get_default_config(dma_glue_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_ring(&c, false, __builtin_ctz(sizeof(vactive_line)));
+    channel_config_set_dreq(&c, DREQ_HSTX);
+    channel_config_set_bswap(&c, DO_BSWAP);
+    channel_config_set_chain_to(&c, dma_fb_channel);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(dma_glue_channel, &c, &hstx_fifo_hw->fifo,
+        vactive_line, count_of(vactive_line), false);
+
+    // fb: a row of pixels, then tick.  The read address is set by the program.
+    c = dma_channel_get_default_config(dma_fb_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+#if VIDEO_LINE_BUFFERS
+    channel_config_set_ring(&c, false, VIDEO_RING_BITS);
+#endif
+    channel_config_set_dreq(&c, DREQ_HSTX);
+    channel_config_set_bswap(&c, DO_BSWAP);
+    channel_config_set_chain_to(&c, dma_tick_channel);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(dma_fb_channel, &c, &hstx_fifo_hw->fifo,
+        framebuffer, words_per_line, false);
+
+#if VIDEO_LINE_BUFFERS
+    // fill: a row into the ring.  Both addresses are set by the program.
+    c = dma_channel_get_default_config(dma_fill_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, VIDEO_RING_BITS);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(dma_fill_channel, &c, video_line_ring,
+        NULL, VIDEO_ROW_WORDS, false);
+#endif
+
+    // tick: one entry of video_ticks[] to MULTI_CHAN_TRIGGER
+    c = dma_channel_get_default_config(dma_tick_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(dma_tick_channel, &c, &dma_hw->multi_channel_trigger,
+        video_ticks, 1, false);
+
+    // cmd: one descriptor into px's registers.  This wraps the write back
+    // to px's READ_ADDR after 16 bytes, i.e. all four alias 0 registers.
+    c = dma_channel_get_default_config(dma_cmd_channel);
     channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
     channel_config_set_read_increment(&c, true);
     channel_config_set_write_increment(&c, true);
-    // This wraps the transfer back to the start of the write address.
-    size_t wrap = 3; // 8 bytes because we write two DMA registers.
-    volatile uint32_t *write_addr = &dma_hw->ch[self->dma_pixel_channel].al3_transfer_count;
-    channel_config_set_ring(&c, true, wrap);
-    // No chain because we use an interrupt to reload this channel instead of a
-    // third channel.
-    dma_channel_configure(
-        self->dma_command_channel,
-        &c,
-        write_addr,
-        self->dma_commands,
-        (1 << wrap) / sizeof(uint32_t),
-        false
-        );
-
-    dma_hw->ints2 = (1u << self->dma_pixel_channel);
-    dma_hw->inte2 = (1u << self->dma_pixel_channel);
+    channel_config_set_ring(&c, true, 4);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(dma_cmd_channel, &c, &dma_hw->ch[dma_px_channel].read_addr,
+        video_program, sizeof(dma_descr_t) / sizeof(uint32_t), false);
+
+    dma_hw->ints2 = 1u << dma_px_channel;
+    dma_hw->inte2 = 1u << dma_px_channel;
     irq_set_exclusive_handler(DMA_IRQ_2, dma_irq_handler);
     irq_set_enabled(DMA_IRQ_2, true);
 
     bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_W_BITS | BUSCTRL_BUS_PRIORITY_DMA_R_BITS;
 
-    active_picodvi = self;
-
-    dma_irq_handler();
+    dma_channel_start(dma_cmd_channel);
 }
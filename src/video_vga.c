@@ -39,9 +39,11 @@
 #include "hardware/dma.h"
 #include "hardware/gpio.h"
 #include "hardware/structs/padsbank0.h"
+#include "pico/time.h"
 #include "pio_video.pio.h"
 
 #include "hw.h"
+#include "video.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 /* VESA VGA mode 640x480@60 */
@@ -82,233 +84,281 @@
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
-// Video DMA, framebuffer pointers
+// Video DMA frame program
 
-static uint32_t video_null[VIDEO_VISIBLE_WPL];
-static uint32_t *video_framebuffer;
+/* pio_video expects each display line to be composed of two words of config
+ * describing the line geometry and whether VS is asserted, followed by
+ * visible data.
+ *
+ * Lines outside the framebuffer are sent from a small buffer holding a whole
+ * line: config, then 6 words of black.  The porches are stretched to make up
+ * the rest of the line, so the buffer is 8 words and a run of blank lines
+ * is a single DMA transfer replaying it from a read ring.
+ */
+#define VIDEO_BLANK_WPL         6
+#define VIDEO_BLANK_PORCHES     ((VIDEO_HBP - 3) + (VIDEO_HFP - 4) + \
+                                 VIDEO_HRES - (VIDEO_BLANK_WPL * 32))
 
-/* DMA buffer containing 2 pairs of per-line config words, for VS and not-VS: */
-static uint32_t video_dma_cfg[4];
+#if VIDEO_BLANK_PORCHES > (2 * 255)
+#error "VIDEO_BLANK_WPL: blank line porches don't fit the timing word"
+#endif
 
-/* 3 DMA channels are used.  The first to transfer data to PIO, and
- * the other two to transfer descriptors to the first channel.
+/* Blank lines, for VS and not-VS: */
+static uint32_t video_blank_line[2][2 + VIDEO_BLANK_WPL] __attribute__((aligned(32)));
+/* Per-line config words for framebuffer lines: */
+static uint32_t video_dma_cfg[2];
+
+/* "Another caveat is that multiple channels should not be connected
+ * to the same DREQ.":
+ * Only one DMA channel can do the transfers to PIO, because of how the
+ * credit-based flow control works.  So, _only_ the tx channel transfers
+ * into the PIO FIFO, and it's fed descriptors by the others, which loop
+ * over a whole frame without the CPU:
+ *
+ *  cmd:  copies the next descriptor into tx's registers, the last write
+ *        triggering it.  It reads video_program[], or video_row_descr[]
+ *        for a framebuffer line: its config, then its data.
+ *  tx:   executes a descriptor, then chains back to cmd (or, for line
+ *        data, to save).  A program descriptor is either a run of blank
+ *        lines, or a single-word poke of a register or of
+ *        video_row_descr[].
+ *  save: copies tx's read address, i.e. the start of the next row, into
+ *        the data descriptor.  Then chains to tick.
+ *  tick: counts rows by copying the next entry of video_ticks[] to cmd's
+ *        read address (and triggering it):  video_row_descr for another
+ *        row, or for the last entry where the program continues.
+ *
+ * A run of n rows is started by pointing the data descriptor at the first
+ * row, tick at the last n entries of video_ticks[], the last entry at the
+ * next descriptor and then pointing cmd at video_row_descr.  After the
+ * last row, a descriptor raises an IRQ to count the frame.  The last
+ * descriptor points cmd back at the start of the program.
  */
-static uint8_t video_dmach_tx;
-static uint8_t video_dmach_descr_cfg;
-static uint8_t video_dmach_descr_data;
-
 typedef struct {
-        const void *raddr;
-        void *waddr;
+        const volatile void *raddr;
+        volatile void *waddr;
         uint32_t count;
         uint32_t ctrl;
 } dma_descr_t;
 
-static dma_descr_t video_dmadescr_cfg;
-static dma_descr_t video_dmadescr_data;
+#define VIDEO_TICKS             128
+#define VIDEO_RUNS              ((VIDEO_FB_VRES + VIDEO_TICKS - 1) / VIDEO_TICKS)
+/* 2 blank runs before the framebuffer, a poke for the first row and 3
+ * per run, the IRQ, the blank run after and the restart:
+ */
+#define VIDEO_PROGRAM_LEN       (2 + 1 + 3*VIDEO_RUNS + 3)
 
-static volatile unsigned int video_current_y = 0;
+static dma_descr_t video_program[VIDEO_PROGRAM_LEN];
+static uint32_t video_poke_data[VIDEO_PROGRAM_LEN];
+static unsigned int video_program_len;
+static dma_descr_t video_row_descr[2];
+static uint32_t video_ticks[VIDEO_TICKS];
 
-static int      __not_in_flash_func(video_get_visible_y)(unsigned int y) {
-        if ((y >= VIDEO_FB_V_VIS_START) && (y < VIDEO_FB_V_VIS_END)) {
-                return y - VIDEO_FB_V_VIS_START;
-        } else {
-                return -1;
-        }
+static uint8_t video_dmach_cmd;
+static uint8_t video_dmach_tx;
+static uint8_t video_dmach_save;
+static uint8_t video_dmach_tick;
+
+static uint32_t video_lines_ctrl;
+static uint32_t video_poke_ctrl;
+static uint32_t video_irq_sink;
+
+volatile unsigned int video_frame_count = 0;
+#if SHOW_STATS
+volatile unsigned int video_irq_us = 0;
+#endif
+
+static void     video_program_add(const volatile void *raddr, volatile void *waddr,
+                                  uint32_t count, uint32_t ctrl)
+{
+        dma_descr_t *d = &video_program[video_program_len++];
+        d->raddr = raddr;
+        d->waddr = waddr;
+        d->count = count;
+        d->ctrl = ctrl;
 }
 
-static const uint32_t   *__not_in_flash_func(video_line_addr)(unsigned int y)
+/* Send n copies of a blank line to PIO */
+static void     video_program_lines(const uint32_t *line, unsigned int n)
 {
-        int vy = video_get_visible_y(y);
-        if (vy >= 0)
-                return (const uint32_t *)&video_framebuffer[vy * VIDEO_VISIBLE_WPL];
-        else
-                return (const uint32_t *)video_null;
+        if (n == 0)
+                return;
+        video_program_add(line, &pio0_hw->txf[0], n * count_of(video_blank_line[0]),
+                          video_lines_ctrl);
 }
 
-static const uint32_t   *__not_in_flash_func(video_cfg_addr)(unsigned int y)
+/* Write value to a register.  With chain false, tx doesn't return to cmd
+ * (the poke itself hands over control).
+ */
+static void     video_program_poke(volatile void *reg, uint32_t value, bool chain)
 {
-        return &video_dma_cfg[(y < VIDEO_VSW) ? 0 : 2];
+        uint32_t ctrl = video_poke_ctrl |
+                ((chain ? video_dmach_cmd : video_dmach_tx) << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB);
+        video_poke_data[video_program_len] = value;
+        video_program_add(&video_poke_data[video_program_len], reg, 1, ctrl);
 }
 
-static void    __not_in_flash_func(video_dma_prep_new)()
+/* Raise DMA_IRQ_0 (by a dummy poke that isn't IRQ_QUIET) */
+static void     video_program_irq()
 {
-        /* The descriptor DMA read pointers have moved on; reset them.
-         * The write pointers wrap so should be pointing to the
-         * correct DMA regs.
-         */
-        dma_hw->ch[video_dmach_descr_cfg].read_addr = (uintptr_t)&video_dmadescr_cfg;
-        dma_hw->ch[video_dmach_descr_cfg].transfer_count = 4;
-        dma_hw->ch[video_dmach_descr_data].read_addr = (uintptr_t)&video_dmadescr_data;
-        dma_hw->ch[video_dmach_descr_data].transfer_count = 4;
-
-        /* Configure the two DMA descriptors, video_dmadescr_cfg and
-         * video_dmadescr_data, to transfer from video config/data corresponding
-         * to the current line.
-         *
-         * These descriptors will be used to program the video_dmach_tx channel,
-         * pushing the buffer to PIO.
-         *
-         * This can be relatively relaxed, as it's triggered as line data
-         * starts; we have until the end of the video line (when the descriptors
-         * are retriggered) to program them.
-         *
-         * FIXME: this time could be used for something clever like split-screen
-         * (e.g. info/text lines) constructed on-the-fly.
-         */
-        video_dmadescr_cfg.raddr = video_cfg_addr(video_current_y);
-        video_dmadescr_data.raddr = video_line_addr(video_current_y);
+        uint32_t ctrl = (video_poke_ctrl & ~DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS) |
+                (video_dmach_cmd << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB);
+        video_program_add(&video_poke_data[video_program_len], &video_irq_sink, 1, ctrl);
+}
 
-        /* Frame done */
-        if (++video_current_y >= VIDEO_V_TOTAL)
-                video_current_y = 0;
+static void     video_program_build(uint32_t *framebuffer)
+{
+        video_program_len = 0;
+
+        video_program_lines(video_blank_line[0], VIDEO_VSW);
+        video_program_lines(video_blank_line[1], VIDEO_FB_V_VIS_START - VIDEO_VSW);
+
+        video_program_poke(&video_row_descr[1].raddr, (uintptr_t)framebuffer, true);
+        for (unsigned int row = 0; row < VIDEO_FB_VRES; row += VIDEO_TICKS) {
+                unsigned int run = VIDEO_FB_VRES - row;
+                if (run > VIDEO_TICKS)
+                        run = VIDEO_TICKS;
+                video_program_poke(&dma_hw->ch[video_dmach_tick].read_addr,
+                                   (uintptr_t)&video_ticks[VIDEO_TICKS - run], true);
+                /* Resume after this run's last descriptor: */
+                video_program_poke(&video_ticks[VIDEO_TICKS - 1],
+                                   (uintptr_t)&video_program[video_program_len + 2], true);
+                video_program_poke(&dma_hw->ch[video_dmach_cmd].al3_read_addr_trig,
+                                   (uintptr_t)video_row_descr, false);
+        }
+
+        video_program_irq();
+        video_program_lines(video_blank_line[1], VIDEO_V_TOTAL - VIDEO_FB_V_VIS_END);
+
+        video_program_poke(&dma_hw->ch[video_dmach_cmd].read_addr,
+                           (uintptr_t)video_program, true);
 }
 
 static void     __not_in_flash_func(video_dma_irq)()
 {
-        /* The DMA IRQ occurs once the video portion of the line has been
-         * triggered (not when the video transfer completes, but when the
-         * descriptor transfer (that leads to the video transfer!) completes.
-         * All we need to do is reconfigure the descriptors; the video DMA will
-         * re-trigger the descriptors later.
+        /* This IRQ happens once the last framebuffer row has been
+         * sent to PIO, i.e. the framebuffer has been completely read:
          */
-        if (dma_channel_get_irq0_status(video_dmach_descr_data)) {
-                dma_channel_acknowledge_irq0(video_dmach_descr_data);
-                video_dma_prep_new();
-        }
+#if SHOW_STATS
+        uint32_t start = time_us_32();
+#endif
+        dma_hw->ints0 = 1u << video_dmach_tx;
+        video_frame_count++;
+#if SHOW_STATS
+        video_irq_us += time_us_32() - start;
+#endif
 }
 
 static void     video_prep_buffer()
 {
-        memset(video_null, 0xff, VIDEO_VISIBLE_WPL * 4);
-
         unsigned int porch_padding = (VIDEO_HRES - VIDEO_FB_HRES)/2;
         // FIXME: HBP/HFP are prob off by one or so, check
         uint32_t timing = ((VIDEO_HSW - 1) << 23) |
                 ((VIDEO_HBP + porch_padding - 3) << 15) |
                 ((VIDEO_HFP + porch_padding - 4) << 7);
-        video_dma_cfg[0] = timing | 0x80000000;
+        video_dma_cfg[0] = timing;
         video_dma_cfg[1] = VIDEO_FB_HRES - 1;
-        video_dma_cfg[2] = timing;
-        video_dma_cfg[3] = VIDEO_FB_HRES - 1;
+
+        /* The blank line's porches, split evenly: */
+        uint32_t blank_timing = ((VIDEO_HSW - 1) << 23) |
+                ((VIDEO_BLANK_PORCHES / 2) << 15) |
+                ((VIDEO_BLANK_PORCHES - VIDEO_BLANK_PORCHES / 2) << 7);
+        for (int vs = 0; vs < 2; vs++) {
+                uint32_t *line = video_blank_line[vs];
+                line[0] = blank_timing | (vs ? 0 : 0x80000000);
+                line[1] = (VIDEO_BLANK_WPL * 32) - 1;
+                memset(&line[2], 0xff, VIDEO_BLANK_WPL * 4);
+        }
 }
 
 static void     video_init_dma()
 {
-        /* pio_video expects each display line to be composed of two words of config
-         * describing the line geometry and whether VS is asserted, followed by
-         * visible data.
-         *
-         * To avoid having to embed config metadata in the display framebuffer,
-         * we use two DMA transfers to PIO for each line.  The first transfers
-         * the config from a config buffer, and then triggers the second to
-         * transfer the video data from the framebuffer.  (This lets us use a
-         * flat, regular FB.)
-         *
-         * The PIO side emits 1BPP MSB-first.  The other advantage of
-         * using a second DMA transfer is then we can also can
-         * byteswap the DMA of the video portion to match the Mac
-         * framebuffer layout.
-         *
-         *  "Another caveat is that multiple channels should not be connected
-         *   to the same DREQ.":
-         * The final complexity is that only one DMA channel can do the
-         * transfers to PIO, because of how the credit-based flow control works.
-         * So, _only_ channel 0 transfers from $SOME_BUFFER into the PIO FIFO,
-         * and channel 1+2 are used to reprogram/trigger channel 0 from a DMA
-         * descriptor list.
-         *
-         * Two extra channels are used to manage interrupts; ch1 programs ch0,
-         * completes, and does nothing.  (It programs a descriptor that causes
-         * ch0 to transfer config, then trigger ch2 when complete.)  ch2 then
-         * programs ch0 with a descriptor to transfer data, then trigger ch1
-         * when ch0 completes; when ch2 finishes doing that, it produces an IRQ.
-         * Got that?
-         *
-         * The IRQ handler sets up ch1 and ch2 to point to 2 fresh cfg+data
-         * descriptors; the deadline is by the end of ch0's data transfer
-         * (i.e. a whole line).  When ch0 finishes the data transfer it again
-         * triggers ch1, and the new config entry is programmed.
+        /* The PIO side emits 1BPP MSB-first.  Framebuffer rows are
+         * byteswapped by the DMA to match the Mac framebuffer layout.
          */
+        video_dmach_cmd = dma_claim_unused_channel(true);
         video_dmach_tx = dma_claim_unused_channel(true);
-        video_dmach_descr_cfg = dma_claim_unused_channel(true);
-        video_dmach_descr_data = dma_claim_unused_channel(true);
-
-        /* Transmit DMA: config+video data */
-        /* First, make dmacfg for data to transfer from config buffers + data buffers: */
-        dma_channel_config dc_tx_c = dma_channel_get_default_config(video_dmach_tx);
-        channel_config_set_dreq(&dc_tx_c, DREQ_PIO0_TX0);
-        channel_config_set_transfer_data_size(&dc_tx_c, DMA_SIZE_32);
-        channel_config_set_read_increment(&dc_tx_c, true);
-        channel_config_set_write_increment(&dc_tx_c, false);
-        channel_config_set_bswap(&dc_tx_c, false);
-        /* Completion of the config TX triggers the video_dmach_descr_data channel */
-        channel_config_set_chain_to(&dc_tx_c, video_dmach_descr_data);
-        video_dmadescr_cfg.raddr = NULL;                /* Reprogrammed each line */
-        video_dmadescr_cfg.waddr = (void *)&pio0_hw->txf[0];
-        video_dmadescr_cfg.count = 2;                   /* 2 words of video config */
-        video_dmadescr_cfg.ctrl = dc_tx_c.ctrl;
-
-        dma_channel_config dc_tx_d = dma_channel_get_default_config(video_dmach_tx);
-        channel_config_set_dreq(&dc_tx_d, DREQ_PIO0_TX0);
-        channel_config_set_transfer_data_size(&dc_tx_d, DMA_SIZE_32);
-        channel_config_set_read_increment(&dc_tx_d, true);
-        channel_config_set_write_increment(&dc_tx_d, false);
-        channel_config_set_bswap(&dc_tx_d, true);      /* This channel bswaps */
-        /* Completion of the data TX triggers the video_dmach_descr_cfg channel */
-        channel_config_set_chain_to(&dc_tx_d, video_dmach_descr_cfg);
-        video_dmadescr_data.raddr = NULL;               /* Reprogrammed each line */
-        video_dmadescr_data.waddr = (void *)&pio0_hw->txf[0];
-        video_dmadescr_data.count = VIDEO_VISIBLE_WPL;
-        video_dmadescr_data.ctrl = dc_tx_d.ctrl;
-
-        /* Now, the descr_cfg and descr_data channels transfer _those_
-         * descriptors to program the video_dmach_tx channel:
-         */
-        dma_channel_config dcfg = dma_channel_get_default_config(video_dmach_descr_cfg);
-        channel_config_set_transfer_data_size(&dcfg, DMA_SIZE_32);
-        channel_config_set_read_increment(&dcfg, true);
-        channel_config_set_write_increment(&dcfg, true);
-        /* This channel loops on 16-byte/4-wprd boundary (i.e. writes all config): */
-        channel_config_set_ring(&dcfg, true, 4);
-        /* No completion IRQ or chain: the video_dmach_tx DMA completes and triggers
-         * the next 'data' descriptor transfer.
+        video_dmach_save = dma_claim_unused_channel(true);
+        video_dmach_tick = dma_claim_unused_channel(true);
+
+        uint32_t ctrl = DMA_CH0_CTRL_TRIG_IRQ_QUIET_BITS |
+                (DMA_SIZE_32 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB) |
+                DMA_CH0_CTRL_TRIG_EN_BITS;
+        uint32_t tx_ctrl = ctrl |
+                (DREQ_PIO0_TX0 << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB) |
+                DMA_CH0_CTRL_TRIG_INCR_READ_BITS;
+        /* Blank lines loop on their 32-byte buffer: */
+        video_lines_ctrl = tx_ctrl |
+                (5 << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB) |
+                (video_dmach_cmd << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB);
+        /* The chain is chosen per-poke: */
+        video_poke_ctrl = ctrl | (DREQ_FORCE << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB);
+
+        /* A framebuffer line: config, then row, then the data descriptor
+         * carries on from where this row ended.
          */
-        dma_channel_configure(video_dmach_descr_cfg, &dcfg,
+        video_row_descr[0].raddr = video_dma_cfg;
+        video_row_descr[0].waddr = &pio0_hw->txf[0];
+        video_row_descr[0].count = 2;
+        video_row_descr[0].ctrl = tx_ctrl |
+                (video_dmach_cmd << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB);
+        video_row_descr[1].raddr = NULL;                /* Set by the program */
+        video_row_descr[1].waddr = &pio0_hw->txf[0];
+        video_row_descr[1].count = VIDEO_VISIBLE_WPL;
+        video_row_descr[1].ctrl = tx_ctrl | DMA_CH0_CTRL_TRIG_BSWAP_BITS |
+                (video_dmach_save << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB);
+
+        /* The last entry is set by each run: */
+        for (int i = 0; i < VIDEO_TICKS - 1; i++)
+                video_ticks[i] = (uintptr_t)video_row_descr;
+
+        dma_channel_config c;
+
+        /* save: tx's read address into the data descriptor, then tick */
+        c = dma_channel_get_default_config(video_dmach_save);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_chain_to(&c, video_dmach_tick);
+        channel_config_set_irq_quiet(&c, true);
+        dma_channel_configure(video_dmach_save, &c,
+                              &video_row_descr[1].raddr,
                               &dma_hw->ch[video_dmach_tx].read_addr,
-                              &video_dmadescr_cfg,
-                              4 /* 4 words of config */,
-                              false /* Not yet */);
-
-        dma_channel_config ddata = dma_channel_get_default_config(video_dmach_descr_data);
-        channel_config_set_transfer_data_size(&ddata, DMA_SIZE_32);
-        channel_config_set_read_increment(&ddata, true);
-        channel_config_set_write_increment(&ddata, true);
-        channel_config_set_ring(&ddata, true, 4);
-        /* This transfer has a completion IRQ.  Receipt of that means that both
-         * config and data descriptors have been transferred, and should be
-         * reprogrammed for the next line.
-         */
-        dma_channel_set_irq0_enabled(video_dmach_descr_data, true);
-        dma_channel_configure(video_dmach_descr_data, &ddata,
+                              1, false);
+
+        /* tick: one entry of video_ticks[] to cmd's read address, triggering it */
+        c = dma_channel_get_default_config(video_dmach_tick);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_irq_quiet(&c, true);
+        dma_channel_configure(video_dmach_tick, &c,
+                              &dma_hw->ch[video_dmach_cmd].al3_read_addr_trig,
+                              video_ticks,
+                              1, false);
+
+        /* cmd: one descriptor into tx's registers */
+        c = dma_channel_get_default_config(video_dmach_cmd);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, true);
+        /* This channel loops on 16-byte/4-word boundary (i.e. writes all config): */
+        channel_config_set_ring(&c, true, 4);
+        channel_config_set_irq_quiet(&c, true);
+        dma_channel_configure(video_dmach_cmd, &c,
                               &dma_hw->ch[video_dmach_tx].read_addr,
-                              &video_dmadescr_data,
+                              video_program,
                               4 /* 4 words of config */,
                               false /* Not yet */);
 
-        /* Finally, set up video_dmadescr_cfg.raddr and video_dmadescr_data.raddr to point
-         * to next line's video cfg/data buffers.  Then, video_dmach_descr_cfg can be triggered
-         * to start video.
-         */
+        /* The IRQ descriptor completes on tx: */
+        dma_channel_set_irq0_enabled(video_dmach_tx, true);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 /* Initialise PIO, DMA, start sending pixels.  Passed a pointer to a 512x342x1
  * Mac-order framebuffer.
- *
- * FIXME: Add an API to change the FB base after init live, e.g. for bank
- * switching.
  */
 void    video_init(uint32_t *framebuffer)
 {
@@ -334,12 +384,8 @@ void    video_init(uint32_t *framebuffer)
 
         video_init_dma();
 
-        /* Init config word buffers */
-        video_current_y = 0;
-        video_framebuffer = framebuffer;
+        /* Init config word buffers and the first program, and start DMA */
         video_prep_buffer();
-
-        /* Set up pointers to first line, and start DMA */
-        video_dma_prep_new();
-        dma_channel_start(video_dmach_descr_cfg);
+        video_program_build(framebuffer);
+        dma_channel_start(video_dmach_cmd);
 }